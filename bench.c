@@ -0,0 +1,890 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// drives ./crash through pipes and prints one JSON object of results:
+//   ./crash-bench [path/to/crash]
+// sizes can be scaled down with BENCH_SCALE (e.g. 0.1) on small machines
+
+typedef struct {
+    pid_t pid;
+    int in; // the shell's stdin
+    int out; // the shell's stdout
+    char tail[8]; // end of the previous read, in case a prompt straddles two reads
+} shell_t;
+
+const char *crash_path = "./crash";
+const char *PROMPT = "crash> ";
+double scale = 1.0;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int scaled(int n) {
+    int s = n * scale;
+    return s > 0 ? s : 1;
+}
+
+void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+// callers wait for the first prompt with shell_prompts before timing anything
+void shell_start(shell_t *sh, char *const env[]) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1) {
+        die("pipe");
+    }
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    char *argv[] = { (char *)crash_path, NULL };
+    int error = posix_spawn(&sh->pid, crash_path, &fa, NULL, argv, env ? env : environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (error != 0) {
+        errno = error;
+        die(crash_path);
+    }
+    close(in[0]);
+    close(out[1]);
+    sh->in = in[1];
+    sh->out = out[0];
+    sh->tail[0] = '\0';
+}
+
+void shell_send(shell_t *sh, const char *line) {
+    size_t len = strlen(line);
+    while (len > 0) {
+        ssize_t n = write(sh->in, line, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("write");
+        }
+        line += n;
+        len -= n;
+    }
+}
+
+// read until n more prompts have gone by, copying what was read to copy unless it is NULL
+void shell_read(shell_t *sh, int n, FILE *copy) {
+    size_t plen = strlen(PROMPT);
+    char buf[65536 + 8];
+    while (n > 0) {
+        size_t keep = strlen(sh->tail);
+        memcpy(buf, sh->tail, keep);
+        ssize_t got = read(sh->out, buf + keep, sizeof(buf) - keep - 1);
+        if (got <= 0) {
+            fprintf(stderr, "bench: shell exited early\n");
+            exit(1);
+        }
+        size_t len = keep + got;
+        buf[len] = '\0';
+        if (copy) {
+            fwrite(buf + keep, 1, got, copy);
+        }
+        char *p = buf;
+        char *last = buf;
+        while (n > 0 && (p = memmem(p, len - (p - buf), PROMPT, plen))) {
+            n--;
+            p += plen;
+            last = p;
+        }
+        // a partial prompt may be at the very end
+        size_t rest = len - (last - buf);
+        if (rest > plen - 1) {
+            rest = plen - 1;
+        }
+        memcpy(sh->tail, buf + len - rest, rest);
+        sh->tail[rest] = '\0';
+    }
+}
+
+void shell_prompts(shell_t *sh, int n) {
+    shell_read(sh, n, NULL);
+}
+
+// everything the shell printed up to n more prompts, to be freed
+char *shell_output(shell_t *sh, int n) {
+    char *text;
+    size_t len;
+    FILE *copy = open_memstream(&text, &len);
+    if (!copy) {
+        die("open_memstream");
+    }
+    shell_read(sh, n, copy);
+    fclose(copy);
+    return text;
+}
+
+// send one command and time it until the shell prompts again
+double shell_cmd(shell_t *sh, const char *line) {
+    double t0 = now();
+    shell_send(sh, line);
+    shell_prompts(sh, 1);
+    return now() - t0;
+}
+
+// send line n times, in batches so neither side blocks on a full pipe while the other is writing
+void shell_launch_bg(shell_t *sh, const char *line, int n) {
+    for (int i = 0; i < n; i += 100) {
+        int batch = n - i < 100 ? n - i : 100;
+        for (int k = 0; k < batch; k++) {
+            shell_send(sh, line);
+        }
+        shell_prompts(sh, batch);
+    }
+}
+
+void shell_stop(shell_t *sh) {
+    shell_send(sh, "nuke\n");
+    close(sh->in);
+    char buf[4096];
+    while (read(sh->out, buf, sizeof(buf)) > 0);
+    close(sh->out);
+    waitpid(sh->pid, NULL, 0);
+}
+
+// utime + stime of a process in seconds
+double proc_cpu(pid_t pid) {
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f || !fgets(buf, sizeof(buf), f)) {
+        die(path);
+    }
+    fclose(f);
+    unsigned long utime, stime;
+    char *p = strrchr(buf, ')');
+    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// resident set of a process in KB
+long proc_rss_kb(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        die(path);
+    }
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(double *v, int n, double p) {
+    qsort(v, n, sizeof(double), cmp_double);
+    int i = p * (n - 1);
+    return v[i];
+}
+
+bool first = true;
+
+void result(const char *key, double value) {
+    printf("%s\n  \"%s\": %.6g", first ? "{" : ",", key, value);
+    first = false;
+    fflush(stdout);
+}
+
+// `true` over and over: one round trip through the shell per builtin command
+void bench_true_loop() {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    int n = scaled(2000);
+    double t0 = now();
+    for (int i = 0; i < n; i++) {
+        shell_cmd(&sh, "true\n");
+    }
+    result("true_loop_cmds_per_sec", n / (now() - t0));
+    shell_stop(&sh);
+}
+
+// per-command latency of a foreground launch, for posix_spawn and the fork fallback
+void bench_spawn_latency(const char *mode) {
+    char var[64];
+    snprintf(var, sizeof(var), "CRASH_SPAWN=%s", mode);
+    int nenv = 0;
+    while (environ[nenv]) {
+        nenv++;
+    }
+    char *env[nenv + 2];
+    memcpy(env, environ, nenv * sizeof(char *));
+    env[nenv] = var;
+    env[nenv + 1] = NULL;
+
+    shell_t sh;
+    shell_start(&sh, env);
+    shell_prompts(&sh, 1);
+    int n = scaled(2000);
+    double *lat = malloc(n * sizeof(double));
+    double t0 = now();
+    for (int i = 0; i < n; i++) {
+        // by path, so it is spawned rather than run as the builtin
+        lat[i] = shell_cmd(&sh, "/bin/true\n");
+    }
+    double total = now() - t0;
+    char key[64];
+    snprintf(key, sizeof(key), "spawn_%s_per_sec", mode);
+    result(key, n / total);
+    snprintf(key, sizeof(key), "spawn_%s_p50_us", mode);
+    result(key, percentile(lat, n, 0.50) * 1e6);
+    snprintf(key, sizeof(key), "spawn_%s_p99_us", mode);
+    result(key, percentile(lat, n, 0.99) * 1e6);
+    free(lat);
+    shell_stop(&sh);
+}
+
+// launch n background sleeps, then time `jobs` and a mass `nuke` against that many live jobs
+void bench_jobs(int n) {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    double t0 = now();
+    shell_launch_bg(&sh, "sleep 1000 &\n", n);
+    char key[64];
+    snprintf(key, sizeof(key), "bg_launch_per_sec_%d", n);
+    result(key, n / (now() - t0));
+    snprintf(key, sizeof(key), "jobs_latency_ms_%d", n);
+    result(key, shell_cmd(&sh, "jobs\n") * 1e3);
+    snprintf(key, sizeof(key), "nuke_latency_ms_%d", n);
+    result(key, shell_cmd(&sh, "nuke\n") * 1e3);
+    shell_stop(&sh);
+}
+
+// run crash on a script with its output thrown away, returns the wall time
+double run_script(const char *path) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    char *argv[] = { (char *)crash_path, (char *)path, NULL };
+    pid_t pid;
+    double t0 = now();
+    int error = posix_spawn(&pid, crash_path, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (error != 0) {
+        errno = error;
+        die(crash_path);
+    }
+    waitpid(pid, NULL, 0);
+    return now() - t0;
+}
+
+// crash -c cmd with its output thrown away, or stderr kept in err_path if not NULL; returns
+// its exit code
+int run_c(const char *cmd, const char *err_path) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, err_path ? err_path : "/dev/null",
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    char *argv[] = { (char *)crash_path, "-c", (char *)cmd, NULL };
+    pid_t pid;
+    int error = posix_spawn(&pid, crash_path, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (error != 0) {
+        errno = error;
+        die(crash_path);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// write head, then body n times as a printf format given the line number (from 1), then tail
+// into a temporary script, and run crash on it; returns the wall time. head and tail may be NULL
+double script_bench(const char *head, const char *body, int n, const char *tail) {
+    char path[] = "/tmp/crash-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        die("mkstemp");
+    }
+    FILE *f = fdopen(fd, "w");
+    if (head) {
+        fputs(head, f);
+    }
+    for (int i = 1; i <= n; i++) {
+        fprintf(f, body, i);
+    }
+    if (tail) {
+        fputs(tail, f);
+    }
+    if (fclose(f) != 0) {
+        die(path);
+    }
+    double t = run_script(path);
+    unlink(path);
+    return t;
+}
+
+// batch mode over a multi-megabyte script of long builtin lines, so the time is mostly lexing;
+// the pipe is quoted, since a builtin in a real pipeline would run as a process
+void bench_lex() {
+    const char *words = " plain words 'single quoted' \"double \\\" quoted\" esc\\ aped 'x|y'";
+    char line[8192];
+    size_t len = 0;
+    len += snprintf(line, sizeof(line), "jobs");
+    while (len + strlen(words) + 2 < sizeof(line)) {
+        len += snprintf(line + len, sizeof(line) - len, "%s", words);
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+    int n = (64000000L * scale + len - 1) / len;
+    result("lex_script_mb_per_sec", (double)n * len / script_bench(NULL, line, n, NULL) / 1e6);
+}
+
+// n launches of `test` by bare name behind 64 missing PATH directories: with the path cache warm,
+// and with `hash -r` before each one so every launch searches PATH again
+void bench_path_cache(int n) {
+    char head[4096];
+    size_t len = snprintf(head, sizeof(head), "export PATH=");
+    for (int i = 0; i < 64; i++) {
+        len += snprintf(head + len, sizeof(head) - len, "/nonexistent/crash-bench/%d:", i);
+    }
+    const char *env_path = getenv("PATH");
+    snprintf(head + len, sizeof(head) - len, "%s\n", env_path ? env_path : "/usr/bin:/bin");
+    char key[64];
+    snprintf(key, sizeof(key), "path_warm_launches_per_sec_%d", n);
+    result(key, n / script_bench(head, "test\n", n, NULL));
+    snprintf(key, sizeof(key), "path_cold_launches_per_sec_%d", n);
+    result(key, n / script_bench(head, "hash -r\ntest\n", n, NULL));
+}
+
+// a chain of n `after %prev /bin/true &` nodes declared up front, against the same n commands run
+// one after the other in the foreground: what the scheduler adds per edge
+void bench_dag(int n) {
+    char key[64];
+    snprintf(key, sizeof(key), "seq_ms_per_cmd_%d", n);
+    result(key, script_bench(NULL, "/bin/true\n", n, NULL) * 1e3 / n);
+    snprintf(key, sizeof(key), "dag_chain_ms_per_node_%d", n);
+    result(key, script_bench("/bin/true &\n", "after %%%d /bin/true &\n", n - 1, "wait\n") * 1e3 / n);
+}
+
+// n CPU-bound jobs at once, two per online CPU, left to the scheduler and then spread by place on
+void bench_place(int n) {
+    char body[128];
+    snprintf(body, sizeof(body), "sh -c 'i=0; while [ $i -lt %d ]; do i=$((i+1)); done' &\n", scaled(200000));
+    char key[64];
+    snprintf(key, sizeof(key), "place_off_ms_%d_busy_jobs", n);
+    result(key, script_bench("place off\n", body, n, "wait\n") * 1e3);
+    snprintf(key, sizeof(key), "place_on_ms_%d_busy_jobs", n);
+    result(key, script_bench("place on\n", body, n, "wait\n") * 1e3);
+}
+
+// the same run of commands with the shell's metrics off and on, for what recording them costs
+void bench_stats(int n) {
+    char key[64];
+    snprintf(key, sizeof(key), "stats_off_us_per_cmd_%d", 2 * n);
+    result(key, script_bench("stats off\n", "/bin/true\n/bin/true &\n", n, "wait\n") * 1e6 / (2 * n));
+    snprintf(key, sizeof(key), "stats_on_us_per_cmd_%d", 2 * n);
+    result(key, script_bench("stats on\n", "/bin/true\n/bin/true &\n", n, "wait\n") * 1e6 / (2 * n));
+}
+
+// a script loop of trivial builtins, none of which should need a process
+void bench_builtin_script() {
+    int n = scaled(1000000);
+    result("builtin_script_cmds_per_sec", n / script_bench(NULL, "true; echo %d; cd /; pwd\n", n / 4, NULL));
+}
+
+// launch lots of short background jobs and check the shell's memory stays flat once warm;
+// BENCH_SOAK_JOBS=1000000 for the long version
+bool soak_failed = false;
+
+void bench_soak() {
+    const char *env = getenv("BENCH_SOAK_JOBS");
+    int n = env ? atoi(env) : scaled(20000);
+    int warm = n / 10;
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    long rss_warm = 0;
+    for (int i = 0; i < n; i += 1000) {
+        // a long line now and then, so the per-line arena sees some variety
+        shell_launch_bg(&sh, "/bin/true a b c d e f g h i j k l m n o p q r s t u v w x y z | /bin/true &\n", 1);
+        shell_launch_bg(&sh, "/bin/true &\n", (n - i < 1000 ? n - i : 1000) - 1);
+        if (i < warm && i + 1000 >= warm) {
+            rss_warm = proc_rss_kb(sh.pid);
+        }
+    }
+    long rss_end = proc_rss_kb(sh.pid);
+    result("soak_jobs", n);
+    result("soak_rss_warm_kb", rss_warm);
+    result("soak_rss_end_kb", rss_end);
+    // allow for page-granular noise, not for growth with the number of jobs
+    if (rss_end - rss_warm > 1024) {
+        soak_failed = true;
+    }
+    shell_stop(&sh);
+}
+
+// fan-out/fan-in: n background sleeps, then `wait` for all of them; the shell's CPU time
+// during the wait should not grow with n beyond the work of reaping
+void bench_wait(int n) {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    shell_launch_bg(&sh, "sleep 2 &\n", n);
+    double before = proc_cpu(sh.pid);
+    char key[64];
+    snprintf(key, sizeof(key), "wait_all_ms_%d", n);
+    result(key, shell_cmd(&sh, "wait\n") * 1e3);
+    snprintf(key, sizeof(key), "wait_all_shell_cpu_ms_%d", n);
+    result(key, (proc_cpu(sh.pid) - before) * 1e3);
+    shell_stop(&sh);
+}
+
+// live (non-zombie) processes running `sleep 1001`
+int count_tree_sleeps() {
+    DIR *d = opendir("/proc");
+    if (!d) {
+        die("/proc");
+    }
+    int n = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        char path[300], buf[64];
+        snprintf(path, sizeof(path), "/proc/%s/cmdline", e->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        size_t len = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        if (len == sizeof("sleep\0" "1001") && memcmp(buf, "sleep\0" "1001", len) == 0) {
+            n++; // zombies have an empty cmdline
+        }
+    }
+    closedir(d);
+    return n;
+}
+
+// n jobs that each leave a grandchild in their process group (off our pipe, so a survivor
+// cannot hang the bench), then one `nuke` for all of them;
+// nuke returns once every job is reaped, and no grandchild may survive it
+void bench_nuke_tree(int n) {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    shell_launch_bg(&sh, "sh -c 'sleep 1001 >/dev/null & exec sleep 1001' &\n", n);
+    char key[64];
+    snprintf(key, sizeof(key), "nuke_tree_latency_ms_%d", n);
+    result(key, shell_cmd(&sh, "nuke\n") * 1e3);
+    usleep(100000); // the orphaned grandchildren die asynchronously
+    snprintf(key, sizeof(key), "nuke_tree_survivors_%d", n);
+    result(key, count_tree_sleeps());
+    shell_stop(&sh);
+}
+
+// the same in cgroup mode with grandchildren that setsid out of the job's process group, which
+// only cgroup.kill still reaches; also how fast jobs launch when each gets a cgroup
+void bench_nuke_cgroup(int n) {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    shell_cmd(&sh, "cgroup on\n");
+    double t0 = now();
+    shell_launch_bg(&sh, "sh -c 'setsid sleep 1001 >/dev/null & exec sleep 1001' &\n", n);
+    char key[64];
+    snprintf(key, sizeof(key), "cgroup_launch_jobs_per_s_%d", n);
+    result(key, n / (now() - t0));
+    snprintf(key, sizeof(key), "nuke_cgroup_latency_ms_%d", n);
+    result(key, shell_cmd(&sh, "nuke\n") * 1e3);
+    usleep(100000);
+    snprintf(key, sizeof(key), "nuke_cgroup_survivors_%d", n);
+    result(key, count_tree_sleeps());
+    shell_stop(&sh);
+}
+
+// n jobs launched with the state file on, the shell killed, and a new shell taking them over from
+// the file; nuke from the new shell must leave none of them running
+void bench_state(int n) {
+    char path[64], cmd[96];
+    snprintf(path, sizeof(path), "/tmp/crash-bench-state-%d", getpid());
+    snprintf(cmd, sizeof(cmd), "state %s\n", path);
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    shell_cmd(&sh, cmd);
+    double t0 = now();
+    shell_launch_bg(&sh, "sleep 1001 &\n", n);
+    char key[64];
+    snprintf(key, sizeof(key), "state_bg_launch_per_sec_%d", n);
+    result(key, n / (now() - t0));
+    kill(sh.pid, SIGKILL);
+    waitpid(sh.pid, NULL, 0);
+    close(sh.in);
+    close(sh.out);
+
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    snprintf(key, sizeof(key), "state_adopt_ms_%d", n);
+    result(key, shell_cmd(&sh, cmd) * 1e3);
+    snprintf(key, sizeof(key), "state_nuke_adopted_ms_%d", n);
+    result(key, shell_cmd(&sh, "nuke\n") * 1e3);
+    usleep(100000);
+    snprintf(key, sizeof(key), "state_survivors_%d", n);
+    result(key, count_tree_sleeps());
+    shell_stop(&sh);
+    unlink(path);
+}
+
+// n concurrent `timeout 2` jobs, all on the one timerfd: how late `wait` returns after the
+// last deadline, and what the shell spent firing them. The last job has the last deadline and
+// is launched alone, timed from just before it is sent, so the figure can only overstate the
+// lateness, by that one launch
+void bench_timeouts(int n) {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    shell_launch_bg(&sh, "timeout 2 sleep 1000 &\n", n - 1);
+    double before = proc_cpu(sh.pid);
+    double t0 = now();
+    shell_cmd(&sh, "timeout 2 sleep 1000 &\n");
+    shell_cmd(&sh, "wait\n");
+    char key[64];
+    snprintf(key, sizeof(key), "timeout_late_ms_%d", n);
+    result(key, (now() - t0) * 1e3 - 2000);
+    snprintf(key, sizeof(key), "timeout_shell_cpu_ms_%d", n);
+    result(key, (proc_cpu(sh.pid) - before) * 1e3);
+    shell_stop(&sh);
+}
+
+// a job that timed out reports 124 however it is waited for, and `time` says so too
+bool codes_failed = false;
+
+void bench_timeout_codes() {
+    const char *cmds[] = {
+        "timeout 0.3 sleep 5",
+        "timeout 0.3 sleep 5 & wait %1",
+        "timeout 0.3 sleep 5 & wait -n",
+        "time timeout 0.3 sleep 5",
+    };
+    char err_path[64];
+    snprintf(err_path, sizeof(err_path), "/tmp/crash-bench-err-%d", getpid());
+    int wrong = 0;
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+        int code = run_c(cmds[i], err_path);
+        if (code != 124) {
+            fprintf(stderr, "bench: `%s` exited %d, not 124\n", cmds[i], code);
+            wrong++;
+        }
+    }
+    // the last one was `time`, whose report is in err_path
+    char buf[512] = "";
+    FILE *f = fopen(err_path, "r");
+    if (f) {
+        buf[fread(buf, 1, sizeof(buf) - 1, f)] = '\0';
+        fclose(f);
+    }
+    if (!strstr(buf, "exit 124")) {
+        fprintf(stderr, "bench: `time` reported a timeout as: %s\n", buf);
+        wrong++;
+    }
+    unlink(err_path);
+    result("timeout_code_mismatches", wrong);
+    if (wrong > 0) {
+        codes_failed = true;
+    }
+}
+
+// n captured jobs each writing 4MB into its joblog: how fast the shell drains them
+void bench_capture(int n) {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    shell_cmd(&sh, "capture on\n");
+    double before = proc_cpu(sh.pid);
+    double t0 = now();
+    for (int i = 0; i < n; i++) {
+        shell_send(&sh, "head -c 4194304 /dev/zero &\n");
+    }
+    shell_prompts(&sh, n);
+    shell_cmd(&sh, "wait\n");
+    double t = now() - t0;
+    char key[64];
+    snprintf(key, sizeof(key), "capture_mb_per_s_%d", n);
+    result(key, n * 4.0 / t);
+    snprintf(key, sizeof(key), "capture_shell_cpu_ms_%d", n);
+    result(key, (proc_cpu(sh.pid) - before) * 1e3);
+    shell_stop(&sh);
+}
+
+int ctl_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        die(path);
+    }
+    return fd;
+}
+
+// read until n more reply lines have come in
+void ctl_replies(int fd, int n) {
+    char buf[65536];
+    while (n > 0) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0) {
+            die("control socket");
+        }
+        for (ssize_t i = 0; i < len; i++) {
+            n -= buf[i] == '\n';
+        }
+    }
+}
+
+// the control socket: n `stats` requests pipelined 1000 deep, then 4 clients each pipelining
+// m `spawn -w` requests at once
+void bench_ctl(int n, int m) {
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/tmp/crash-bench-%d.sock", getpid());
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    snprintf(line, sizeof(line), "serve %s\n", path);
+    shell_cmd(&sh, line);
+    int fd = ctl_connect(path);
+    char batch[1000 * 6];
+    for (int i = 0; i < 1000; i++) {
+        memcpy(batch + i * 6, "stats\n", 6);
+    }
+    double t0 = now();
+    for (int i = 0; i < n; i += 1000) {
+        int k = n - i < 1000 ? n - i : 1000;
+        if (write(fd, batch, k * 6) != k * 6) {
+            die("control socket");
+        }
+        ctl_replies(fd, k);
+    }
+    char key[64];
+    snprintf(key, sizeof(key), "ctl_stats_per_s_%d", n);
+    result(key, n / (now() - t0));
+    close(fd);
+
+    int fds[4];
+    for (int c = 0; c < 4; c++) {
+        fds[c] = ctl_connect(path);
+    }
+    t0 = now();
+    for (int c = 0; c < 4; c++) {
+        for (int i = 0; i < m; i++) {
+            const char *req = "spawn -w /bin/true\n";
+            if (write(fds[c], req, strlen(req)) != (ssize_t)strlen(req)) {
+                die("control socket");
+            }
+        }
+    }
+    for (int c = 0; c < 4; c++) {
+        ctl_replies(fds[c], m);
+        close(fds[c]);
+    }
+    snprintf(key, sizeof(key), "ctl_spawn_wait_per_s_%d", 4 * m);
+    result(key, 4 * m / (now() - t0));
+    shell_stop(&sh);
+}
+
+// n jobs (at most 255) blocked reading one FIFO, let go by a single write so they all exit at once,
+// job i with exit code i + 1: every finished notice must name the pid launched under its jid, once,
+// and the control socket's wait must give each jid its own code
+bool storm_failed = false;
+
+void bench_reap_storm(int n) {
+    n = n > 255 ? 255 : n;
+    char fifo[64], sock[64], line[160];
+    snprintf(fifo, sizeof(fifo), "/tmp/crash-bench-%d.fifo", getpid());
+    snprintf(sock, sizeof(sock), "/tmp/crash-bench-%d-storm.sock", getpid());
+    unlink(fifo);
+    if (mkfifo(fifo, 0600) == -1) {
+        die("mkfifo");
+    }
+    // also a writer, so the jobs' opens never block and the pipe holds every line until read
+    int gate = open(fifo, O_RDWR | O_CLOEXEC);
+    if (gate == -1) {
+        die(fifo);
+    }
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    snprintf(line, sizeof(line), "serve %s\n", sock);
+    shell_cmd(&sh, line);
+    int *jid_of = calloc(n, sizeof(int));
+    pid_t *pid_of = calloc(n, sizeof(pid_t));
+    for (int i = 0; i < n; i++) {
+        snprintf(line, sizeof(line), "sh -c 'read x < %s; exit %d' &\n", fifo, i + 1);
+        shell_send(&sh, line);
+        char *out = shell_output(&sh, 1);
+        if (sscanf(out, "[%d] (%d)  running", &jid_of[i], &pid_of[i]) != 2) {
+            fprintf(stderr, "bench: reap storm job %d did not start: %s\n", i, out);
+            exit(1);
+        }
+        free(out);
+    }
+    int mismatches = 0;
+    char *lines = malloc(n);
+    memset(lines, '\n', n);
+    double t0 = now();
+    if (write(gate, lines, n) != n) {
+        die("write");
+    }
+    shell_send(&sh, "wait\n");
+    char *out = shell_output(&sh, 1);
+    double t = now() - t0;
+    int *seen = calloc(n, sizeof(int));
+    for (char *p = out; (p = strchr(p, '[')); p++) {
+        int jid, pid;
+        char state[16];
+        if (sscanf(p, "[%d] (%d)  %15s", &jid, &pid, state) != 3) {
+            continue;
+        }
+        int i = jid - jid_of[0];
+        if (i < 0 || i >= n || jid_of[i] != jid || pid_of[i] != pid || strcmp(state, "finished") != 0) {
+            mismatches++;
+        } else {
+            seen[i]++;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        mismatches += seen[i] != 1;
+    }
+    // the statuses, pipelined, in the order asked
+    int fd = ctl_connect(sock);
+    FILE *replies = fdopen(fd, "r");
+    for (int i = 0; i < n; i++) {
+        snprintf(line, sizeof(line), "wait %d\n", jid_of[i]);
+        if (write(fd, line, strlen(line)) != (ssize_t)strlen(line)) {
+            die("control socket");
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        int status;
+        if (!fgets(line, sizeof(line), replies) || sscanf(line, "{\"status\":%d}", &status) != 1 || status != i + 1) {
+            mismatches++;
+        }
+    }
+    fclose(replies);
+    char key[64];
+    snprintf(key, sizeof(key), "reap_storm_ms_%d", n);
+    result(key, t * 1e3);
+    snprintf(key, sizeof(key), "reap_storm_mismatches_%d", n);
+    result(key, mismatches);
+    if (mismatches > 0) {
+        storm_failed = true;
+    }
+    free(out);
+    free(seen);
+    free(lines);
+    free(jid_of);
+    free(pid_of);
+    close(gate);
+    unlink(fifo);
+    shell_stop(&sh);
+}
+
+// the shell's own CPU time while a foreground job sleeps
+void bench_fg_wait() {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    double before = proc_cpu(sh.pid);
+    shell_cmd(&sh, "sleep 2\n");
+    result("fg_wait_shell_cpu_ms_per_sec", (proc_cpu(sh.pid) - before) * 1e3 / 2);
+    shell_stop(&sh);
+}
+
+// bytes per second through a four stage pipeline
+void bench_pipeline() {
+    shell_t sh;
+    shell_start(&sh, NULL);
+    shell_prompts(&sh, 1);
+    long bytes = 2000000000L * scale;
+    char cmd[128];
+    // no redirections in crash, so the last stage throws the data away itself
+    snprintf(cmd, sizeof(cmd), "head -c %ld /dev/zero | cat | cat | tail -c 1\n", bytes);
+    double t = shell_cmd(&sh, cmd);
+    result("pipeline_mb_per_sec", bytes / t / 1e6);
+    shell_stop(&sh);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        crash_path = argv[1];
+    }
+    const char *s = getenv("BENCH_SCALE");
+    if (s) {
+        scale = atof(s);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    bench_true_loop();
+    bench_spawn_latency("spawn");
+    bench_spawn_latency("fork");
+    bench_jobs(scaled(1000));
+    bench_jobs(scaled(10000));
+    bench_nuke_tree(scaled(10000));
+    bench_nuke_cgroup(scaled(1000));
+    bench_state(scaled(1000));
+    bench_fg_wait();
+    bench_wait(scaled(1000));
+    bench_timeouts(scaled(2000));
+    bench_timeout_codes();
+    bench_pipeline();
+    bench_capture(scaled(100));
+    bench_ctl(scaled(100000), scaled(250));
+    bench_reap_storm(scaled(250));
+    bench_path_cache(scaled(2000));
+    bench_dag(scaled(1000));
+    bench_place(2 * sysconf(_SC_NPROCESSORS_ONLN));
+    bench_stats(scaled(1000));
+    bench_lex();
+    bench_builtin_script();
+    bench_soak();
+    printf("\n}\n");
+    if (soak_failed) {
+        fprintf(stderr, "bench: shell RSS kept growing during the soak run\n");
+        return 1;
+    }
+    if (storm_failed) {
+        fprintf(stderr, "bench: exits were lost or misattributed in the reap storm\n");
+        return 1;
+    }
+    if (codes_failed) {
+        fprintf(stderr, "bench: a timed out job reported the wrong exit code\n");
+        return 1;
+    }
+    return 0;
+}
@@ -1,582 +1,5087 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
+#include <dirent.h>
 
 #define MAXLINE 1024
 
 #define SIGPID SIGRTMIN + 1
 
+// stands in for `|` in the token vector, so builtins just see an odd argument
+const char PIPE_SEP[] = "|";
+
+struct parallel_run; 
+
+// captured output of one job: the last cap bytes of its stdout and stderr, in an anonymous
+// mapping, so it never touches the disk and only the pages written take memory
+typedef struct {
+    int jid; 
+    char *buf; 
+    size_t cap; 
+    uint64_t written; // bytes ever written, the ring holds the last min(written, cap) of them
+    int fd; // read end of the job's output pipe, -1 after EOF
+    bool done; // the job is gone, the log stays for joblog until LOG_KEEP newer ones are done
+} joblog_t; 
+
+#define LOG_KEEP 32
+
+// one connection to the control socket (see serve): requests come in one per line and each gets
+// one JSON line back, in order
+typedef struct {
+    int fd; 
+    int slot; // index in ctl_clients, and the id its epoll events carry
+    char *in; // read but not handled yet
+    size_t in_len; 
+    size_t in_cap; 
+    char *out; // replies not written yet
+    size_t out_len; 
+    size_t out_cap; 
+    bool eof; // the peer is done sending, close once everything it asked is answered
+    uint32_t events; // what epoll watches for it now
+    int pending; // a wait, nuke or spawn -w still waiting for jobs; later requests queue behind it
+    int *wait_jids; // the jobs it waits for
+    int nwait; 
+    int wait_cap; 
+    int wait_status; // of the last of them to exit
+    int spawn_jid; // for the spawn -w reply
+    pid_t spawn_pid; 
+} ctl_client_t; 
+
+enum { CTL_NONE, CTL_WAIT, CTL_NUKE, CTL_SPAWN };
+
+// how a job is launched, filled in by the time, timeout and limit prefixes
+typedef struct {
+    bool timed; 
+    double timeout; // seconds, 0 for none
+    double kill_after; // SIGKILL this long after the timeout's SIGTERM, 0 for never
+    double cpus; // cpu.max as a number of CPUs, 0 for no limit
+    long long mem_max; // memory.max in bytes, 0 for no limit
+    long pids_max; // pids.max, 0 for no limit
+    bool set_cpus; // place --cpus
+    cpu_set_t place_cpus; 
+    bool set_nice; // place --nice
+    int nice; 
+    bool set_node; // place --node: memory only from this NUMA node
+    int node; 
+} job_opts_t; 
+
+// what a child does to itself between fork and exec, see fork_cmd
+typedef struct {
+    int cg_fd; // cgroup to join, -1 for none
+    const cpu_set_t *cpus; // affinity, NULL to inherit
+    int mpol; // set_mempolicy mode for mems, 0 to inherit
+    unsigned long mems; 
+    bool set_nice; 
+    int nice; 
+} child_setup_t; 
+
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+
+// a job declared with `after`, or a later part of a background `a && b || c &`, not started yet
+typedef struct sched_node {
+    char **argv; // its tokens, copied out of the line, PIPE_SEP kept as is
+    job_opts_t opts; 
+    struct sigaction *act; 
+    struct sigaction *act_fg; 
+    int deps; // jobs still to end before it can go
+    int dep_status; // the first nonzero wait status among them, 0 while they all succeed
+    bool on_failure; // `||`: it runs only if dep_status is nonzero, otherwise only if it is 0
+    bool ready; // in the ready queue, waiting for a slot under sched_limit
+    struct job *job; 
+    struct sched_node *next_ready; 
+} sched_node_t; 
+
 typedef struct job {
     int jid;
-    volatile pid_t pid; 
-    char *name; // remember to free this when deleting a job
-    struct job *next; 
+    volatile pid_t pid; // process group leader, the first stage of a pipeline
+    pid_t *pids; // every stage, each one indexed in by_pid
+    pid_t pid1; // storage behind pids for single-stage jobs
+    int npids; 
+    int nlive; // stages not reaped yet
+    char *name; // from name_alloc(), released with name_free() when the job goes
+    int pidfd; // used to signal the job safely, -1 if pidfds are unsupported
+    bool exited; // reaped, drop the job at the next clean_jobs()
+    bool notified; // print_status already reported how it ended
+    int status; 
+    struct parallel_run *run; // set for tasks started by parallel
+    bool timed; // started by `time`, report its usage when it ends
+    bool waited; // a target of wait or nuke that has not exited yet
+    struct timespec deadline; // when its timeout fires, meaningful while heap_idx >= 0
+    int heap_idx; // position in timer_heap, -1 without a deadline
+    int deadline_sig; // SIGTERM, then SIGKILL once kill_after has passed too
+    double kill_after; // seconds between the two, 0 for no SIGKILL
+    bool timed_out; 
+    joblog_t *log; // set when its output is captured
+    int cg_fd; // its own cgroup's directory, -1 when it has none
+    unsigned long cg_id; // that cgroup is job<cg_id> under cg_root
+    int ctl_waits; // control clients waiting for it to exit
+    sched_node_t *node; // set while the scheduler has not started it
+    int *dependents; // jids of the nodes that run after it
+    int ndependents; 
+    bool scheduled; // started by the scheduler, counts in sched_running until it ends
+    cpu_set_t *cpus; // where it was placed, NULL if it runs wherever
+    int mem_node; // the NUMA node its memory comes from, -1 for no policy
+    bool auto_placed; // its cpus count in cpu_load until it ends
+    bool niced; 
+    int nice; 
+    int state_slot; // its record in the state file, -1 for none
+    bool adopted; // taken over from an earlier shell through the state file, not our child
+    struct timespec start; 
+    struct timespec end; 
+    struct rusage ru; // summed over every stage as they are reaped
+    struct job *next_dead; 
+    struct job *next; // jobs in jid order, for `jobs`
+    struct job *prev; 
     bool suspended; 
 } job_t;
 
+typedef struct {
+    int key; 
+    job_t *job; // NULL marks an empty slot
+} job_slot_t;
+
+// open addressing hash from jid or pid to job, capacity is a power of two
+typedef struct {
+    job_slot_t *slots; 
+    size_t cap; 
+    size_t count; 
+} job_index_t;
+
 typedef struct {
     int curr_jid; 
     job_t *jobs_list; 
+    job_t *tail; 
+    job_index_t by_jid; 
+    job_index_t by_pid; 
+    int n_suspended; 
+    job_t *dead; // exited jobs waiting for clean_jobs()
 } job_list_t; 
 
+// filled by handle_SIGCHLD, emptied by drain_exits() in the main loop
+typedef struct {
+    pid_t pid; 
+    int status; 
+    struct rusage ru; 
+    uint64_t heard_ns; // when the shell learned of the exit, 0 unless stats are on
+} exit_rec_t; 
+
+#define EXIT_RING_SIZE 4096
+
+// one job in the state file (CRASH_STATE), a slot with jid 0 is free
+#define STATE_PIDS 4
+typedef struct {
+    int32_t jid; 
+    int32_t npids; // stages, only the first STATE_PIDS of them are kept
+    int32_t pids[STATE_PIDS];
+    uint64_t start_ticks; // the leader's starttime from /proc/<pid>/stat, a reused pid won't match
+    uint8_t suspended; 
+    char name[63]; // cut short if longer
+} state_rec_t; 
+
+#define STATE_MAGIC "crash-s1"
+typedef struct {
+    char magic[8];
+    int32_t curr_jid; // so the shell taking over goes on numbering from here
+    uint32_t cap; // records after the header
+} state_hdr_t; 
+
+// latencies in ns, HDR-style: exact below 32, then 16 buckets per power of two (within 6.25%)
+#define HIST_SUB 16
+#define HIST_BUCKETS (2 * HIST_SUB + 59 * HIST_SUB)
+typedef struct {
+    const char *name; 
+    const char *help; 
+    uint64_t count; 
+    uint64_t sum; 
+    uint64_t max; 
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t; 
+
+// status lines queue up here and go out with writev at the next flush point
+typedef struct {
+    int fd; 
+    size_t off; // into out.buf, which may move as it grows
+    size_t len; 
+} out_seg_t; 
+
+typedef struct {
+    char *buf; 
+    size_t len; 
+    size_t cap; 
+    out_seg_t *segs; 
+    size_t nsegs; 
+    size_t seg_cap; 
+} out_t; 
+
+// bump allocator for whatever one input line needs, reset before the next line
+typedef struct arena_chunk {
+    struct arena_chunk *next; 
+    size_t cap; 
+    size_t used; 
+    max_align_t data[];
+} arena_chunk_t; 
+
+typedef struct {
+    arena_chunk_t *head; 
+} arena_t; 
+
+typedef struct {
+    arena_chunk_t *chunk; 
+    size_t used; 
+} arena_mark_t; 
+
+#define ARENA_CHUNK 4096
+#define ARENA_KEEP (1 << 20) // a chunk bigger than this is not kept across lines
+
+// fixed-size objects carved from slabs; freed objects are reused, slabs are never returned
+typedef struct {
+    size_t size; 
+    void *free; // singly linked through the first word of each free object
+} pool_t; 
+
+#define POOL_SLAB 64 // objects per slab
+#define NAME_POOL_SIZE 64 // names up to this long (with the NUL) come from name_pool
+
+// how a command on the line ends
+typedef enum {
+    CMD_SEQ, // `;` or the end of the line
+    CMD_BG, // `&`
+    CMD_AND, // `&&`, the next command runs if this one succeeds
+    CMD_OR, // `||`, the next command runs if this one fails
+} cmd_op_t; 
+
+typedef struct {
+    const char **toks; // NULL terminated, PIPE_SEP between pipeline stages
+    cmd_op_t op; 
+} cmd_t; 
+
+// command name -> absolute path, so launches skip the $PATH walk
+typedef struct {
+    char *name; // NULL marks an empty slot
+    char *path; 
+    unsigned hits; 
+} path_slot_t; 
+
+typedef struct {
+    path_slot_t *slots; 
+    size_t cap; 
+    size_t count; 
+    char *path_env; // $PATH the entries were resolved against
+} path_cache_t; 
+
+// lines are read with read(2) so the event loop can wait for input alongside jobs
+typedef struct {
+    int fd; 
+    char *buf; 
+    size_t cap; 
+    size_t start; 
+    size_t end; 
+    bool eof; 
+    bool error; 
+    bool watch; // fd is registered in epfd, false for regular files
+    size_t mapped; // length of the mmap'd script in buf, 0 when buf is malloc'd
+} input_t; 
+
 job_list_t* jobs;
 bool fg = false; 
 bool flag_c = false;
 bool flag_q = false;  
 bool flag_z = false; 
+bool interactive = true; // false for crash -c and crash script: no prompt
+int last_status = 0; // exit code of the last foreground job, what batch mode exits with
+
+int epfd = -1;          // event loop: every blocking wait in the shell goes through here
+int sigfd = -1;         // delivers wait_mask signals while they are blocked
+sigset_t wait_mask;     // SIGCHLD, SIGINT, SIGTSTP, SIGQUIT
+bool reap_pending = false; 
+int wake_pipe[2] = {-1, -1}; // handle_SIGCHLD pokes this to wake the event loop
+int timer_fd = -1; // armed for the earliest deadline in timer_heap
+bool capture_mode = false; // background jobs write to a joblog instead of the terminal
+size_t log_size = 1 << 16; 
+joblog_t **logs = NULL; // in jid order, live and done
+size_t nlogs = 0; 
+size_t logs_cap = 0; 
+bool cgroup_mode = false; // every job gets a cgroup of its own
+int cg_state = 0; // cgroup_init: 0 not tried yet, 1 cg_root is usable, -1 no cgroup v2 here
+int cg_root = -1; // crash-<pid> in our cgroup v2 hierarchy, the parent of every job's cgroup
+char cg_path[PATH_MAX]; 
+char cg_controllers[64]; // what job cgroups get, from cg_root's cgroup.subtree_control
+unsigned long cg_seq = 0; 
+int ctl_fd = -1; // the listening control socket, -1 when not serving
+char ctl_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+ctl_client_t **ctl_clients = NULL; // by slot, NULL for a free one
+size_t nctl = 0; 
+size_t ctl_live = 0; // connected clients
+bool ctl_resume = false; // some client's wait ended, its queued requests can go on
+struct sigaction *ctl_act = NULL; // what serve was started with, for the jobs clients spawn
+struct sigaction *ctl_act_fg = NULL; 
+unsigned long ctl_requests = 0; 
+unsigned long ctl_spawned = 0; 
+int sched_limit = 0; // most scheduler-started jobs alive at once, 0 for no cap (after -j)
+int sched_running = 0; 
+sched_node_t *ready_head = NULL; // nodes whose jobs are done, oldest first
+sched_node_t *ready_tail = NULL; 
+// how recently removed jobs ended, so `after %jid` still works once the job is cleaned up
+#define DONE_KEEP 4096
+struct { int jid; int status; } done_ring[DONE_KEEP]; // status as job_wait_status() says it
+bool place_mode = false; // spread jobs over CPUs and NUMA nodes (place on)
+int topo_state = 0; // topo_init: 0 not read yet, 1 done
+cpu_set_t cpus_online; 
+int ncpus = 0; // highest online CPU + 1
+int nnodes = 0; 
+cpu_set_t *node_cpus = NULL; // by NUMA node
+int *cpu_node = NULL; // by CPU
+int *cpu_order = NULL; // online CPUs, taking turns between nodes
+int *cpu_load = NULL; // auto-placed live jobs on each CPU
+bool stats_on = false; // everything below only moves while this is set
+uint64_t stats_since = 0; // ns, since stats on or stats reset
+unsigned long stat_commands = 0; // through eval()
+unsigned long stat_builtins = 0; 
+unsigned long stat_spawned = 0; // processes, so a pipeline counts each stage
+unsigned long stat_spawn_errors = 0; 
+unsigned long stat_reaped = 0; 
+unsigned long stat_cleaned = 0; // jobs dropped from the table
+uint64_t exit_heard_ns = 0; // first pidfd or SIGCHLD event not yet drained
+uint64_t dispatch_ns = 0; // when eval() got the command being launched
+hist_t hist_spawn = { .name = "spawn", .help = "fork/exec of one process, until the shell has its pid" };
+hist_t hist_reap = { .name = "reap", .help = "exit seen by the event loop until the job table has it" };
+hist_t hist_dispatch = { .name = "dispatch", .help = "eval() until every stage of the job is running" };
+hist_t hist_clean = { .name = "clean", .help = "one clean_jobs() call" };
+int stats_timer = -1; // timerfd for stats dump
+char *state_path = NULL; 
+int state_fd = -1; // locked while this shell owns the file
+state_hdr_t *state_hdr = NULL; // the file mapped, records follow the header
+uint32_t *state_free = NULL; // free slots, the lowest on top
+uint32_t nstate_free = 0; 
+bool subreaper_mode = false; // orphaned descendants are reparented to us rather than to init
+unsigned long orphans_reaped = 0; 
+char *stats_path = NULL; 
+bool stats_prom = false; // stats dump in Prometheus text rather than JSON
+bool input_ready = false; 
+job_t *fg_job = NULL; // its exit is reported by print_status, not drain_exits()
+int wait_remaining = 0; // targets of wait or nuke still running
+job_t *wait_next = NULL; // the first of them to exit, for wait -n
+path_cache_t path_cache = { NULL, 0, 0, NULL };
+out_t out = { NULL, 0, 0, NULL, 0, 0 };
+arena_t line_arena = { NULL };
+pool_t job_pool = { sizeof(job_t), NULL };
+pool_t name_pool = { NAME_POOL_SIZE, NULL };
+
+// single producer (handle_SIGCHLD, or reap_children() with SIGCHLD blocked), single consumer
+exit_rec_t exit_ring[EXIT_RING_SIZE];
+atomic_uint ring_head = 0; 
+atomic_uint ring_tail = 0; 
+volatile sig_atomic_t ring_overflow = 0; 
+
+// min-heap of jobs with a deadline, ordered by job->deadline
+job_t **timer_heap = NULL; 
+size_t heap_len = 0; 
+size_t heap_cap = 0; 
+
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
+
+// epoll_event.data.u64 is a tag in the high half and an id (jid) in the low half
+#define EV_SIGNAL 1ULL
+#define EV_JOB 2ULL
+#define EV_WAKE 3ULL
+#define EV_INPUT 4ULL
+#define EV_TIMER 5ULL
+#define EV_LOG 6ULL
+#define EV_CTL 7ULL // the control socket's listener
+#define EV_CLIENT 8ULL // one of its connections, by slot
+#define EV_STATS 9ULL // time for the next stats dump
+#define EV_DATA(tag, id) (((tag) << 32) | (uint32_t)(id))
+
+void out_reserve(size_t n) {
+    if (out.len + n >= out.cap) {
+        out.cap = (out.len + n + 1) * 2; 
+        out.buf = realloc(out.buf, out.cap);
+        assert(out.buf);
+    }
+}
+
+// queue the n bytes just placed at out.buf + out.len for fd
+void out_commit(int fd, size_t n) {
+    // same fd as the last line: extend it rather than add an iovec
+    if (out.nsegs > 0 && out.segs[out.nsegs - 1].fd == fd) {
+        out.segs[out.nsegs - 1].len += n; 
+    } else {
+        if (out.nsegs == out.seg_cap) {
+            out.seg_cap = out.seg_cap ? out.seg_cap * 2 : 16; 
+            out.segs = realloc(out.segs, out.seg_cap * sizeof(out_seg_t));
+            assert(out.segs);
+        }
+        out.segs[out.nsegs++] = (out_seg_t){ fd, out.len, n };
+    }
+    out.len += n; 
+}
+
+// append to the output queue, without the truncation a fixed buffer would bring
+void out_printf(int fd, const char *fmt, ...) {
+    va_list ap; 
+    while (true) {
+        va_start(ap, fmt);
+        int n = vsnprintf(out.buf + out.len, out.cap - out.len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return; 
+        }
+        if (out.len + n < out.cap) {
+            out_commit(fd, n);
+            return; 
+        }
+        out_reserve(n + 1);
+    }
+}
+
+// raw bytes, NULs and all
+void out_write(int fd, const char *data, size_t len) {
+    out_reserve(len);
+    memcpy(out.buf + out.len, data, len);
+    out_commit(fd, len);
+}
+
+void out_puts(int fd, const char *str) {
+    out_printf(fd, "%s", str);
+}
+
+// one writev per run of lines for the same fd, in the order they were queued
+void out_flush() {
+    size_t i = 0; 
+    while (i < out.nsegs) {
+        int fd = out.segs[i].fd; 
+        struct iovec iov[IOV_MAX];
+        int n = 0; 
+        while (i < out.nsegs && out.segs[i].fd == fd && n < IOV_MAX) {
+            iov[n].iov_base = out.buf + out.segs[i].off; 
+            iov[n].iov_len = out.segs[i].len; 
+            n++; 
+            i++; 
+        }
+        int k = 0; 
+        while (k < n) {
+            ssize_t w = writev(fd, iov + k, n - k);
+            if (w == -1) {
+                if (errno == EINTR) {
+                    continue; 
+                }
+                break; // nowhere to report it
+            }
+            while (k < n && (size_t)w >= iov[k].iov_len) {
+                w -= iov[k++].iov_len; 
+            }
+            if (k < n) {
+                iov[k].iov_base = (char *)iov[k].iov_base + w; 
+                iov[k].iov_len -= w; 
+            }
+        }
+    }
+    out.len = 0; 
+    out.nsegs = 0; 
+}
+
+// async-signal-safe, like clock_gettime
+uint64_t now_ns() {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec; 
+}
+
+int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB) {
+        return v; 
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - 4; 
+    return 2 * HIST_SUB + (msb - 5) * HIST_SUB + (int)(v >> shift) - HIST_SUB; 
+}
+
+// the highest value that lands in bucket i
+uint64_t hist_upper(int i) {
+    if (i < 2 * HIST_SUB) {
+        return i; 
+    }
+    int shift = (i - 2 * HIST_SUB) / HIST_SUB + 1; 
+    uint64_t low = (uint64_t)(HIST_SUB + (i - 2 * HIST_SUB) % HIST_SUB) << shift; 
+    return low + (1ULL << shift) - 1; 
+}
+
+void hist_record(hist_t *h, uint64_t ns) {
+    h->count++; 
+    h->sum += ns; 
+    if (ns > h->max) {
+        h->max = ns; 
+    }
+    h->buckets[hist_index(ns)]++; 
+}
+
+// the value q of the way up, never above the largest one recorded
+uint64_t hist_quantile(const hist_t *h, double q) {
+    uint64_t rank = q * h->count + 0.5; 
+    uint64_t seen = 0; 
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i]; 
+        if (seen >= rank && seen > 0) {
+            return hist_upper(i) < h->max ? hist_upper(i) : h->max; 
+        }
+    }
+    return h->max; 
+}
+
+void *arena_alloc(arena_t *a, size_t n) {
+    n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    arena_chunk_t *c = a->head; 
+    if (!c || c->cap - c->used < n) {
+        // grow geometrically, so the chunk arena_reset keeps soon fits a whole line
+        size_t cap = c ? c->cap * 2 : ARENA_CHUNK; 
+        while (cap < n) {
+            cap *= 2; 
+        }
+        c = malloc(sizeof(arena_chunk_t) + cap);
+        assert(c);
+        c->next = a->head; 
+        c->cap = cap; 
+        c->used = 0; 
+        a->head = c; 
+    }
+    void *p = (char *)c->data + c->used; 
+    c->used += n; 
+    return p; 
+}
+
+// keep the newest chunk (usually big enough for the next line), free the rest
+void arena_reset(arena_t *a) {
+    arena_chunk_t *c = a->head; 
+    if (!c) {
+        return; 
+    }
+    arena_chunk_t *rest = c->next; 
+    if (c->cap > ARENA_KEEP) {
+        rest = c; 
+        a->head = NULL; 
+    } else {
+        c->next = NULL; 
+        c->used = 0; 
+    }
+    while (rest) {
+        arena_chunk_t *next = rest->next; 
+        free(rest);
+        rest = next; 
+    }
+}
+
+arena_mark_t arena_mark(arena_t *a) {
+    return (arena_mark_t){ a->head, a->head ? a->head->used : 0 };
+}
+
+// give back everything allocated since the mark
+void arena_release(arena_t *a, arena_mark_t mark) {
+    while (a->head != mark.chunk) {
+        arena_chunk_t *next = a->head->next; 
+        free(a->head);
+        a->head = next; 
+    }
+    if (a->head) {
+        a->head->used = mark.used; 
+    }
+}
+
+void *pool_get(pool_t *pool) {
+    if (!pool->free) {
+        char *slab = malloc(pool->size * POOL_SLAB);
+        assert(slab);
+        for (int i = POOL_SLAB - 1; i >= 0; i--) {
+            *(void **)(slab + i * pool->size) = pool->free; 
+            pool->free = slab + i * pool->size; 
+        }
+    }
+    void *p = pool->free; 
+    pool->free = *(void **)p; 
+    return p; 
+}
+
+void pool_put(pool_t *pool, void *p) {
+    *(void **)p = pool->free; 
+    pool->free = p; 
+}
+
+char *name_alloc(const char *name) {
+    size_t len = strlen(name) + 1; 
+    char *p = len <= NAME_POOL_SIZE ? pool_get(&name_pool) : malloc(len);
+    assert(p);
+    memcpy(p, name, len);
+    return p; 
+}
+
+void name_free(char *name) {
+    if (strlen(name) + 1 <= NAME_POOL_SIZE) {
+        pool_put(&name_pool, name);
+    } else {
+        free(name);
+    }
+}
+
+size_t index_hash(job_index_t *idx, int key) {
+    uint32_t h = (uint32_t)key * 2654435761u;
+    h ^= h >> 16; 
+    return h & (idx->cap - 1);
+}
+
+void index_init(job_index_t *idx) {
+    idx->cap = 64; 
+    idx->count = 0; 
+    idx->slots = calloc(idx->cap, sizeof(job_slot_t));
+    assert(idx->slots);
+}
+
+job_t *index_get(job_index_t *idx, int key) {
+    size_t i = index_hash(idx, key);
+    while (idx->slots[i].job) {
+        if (idx->slots[i].key == key) {
+            return idx->slots[i].job; 
+        }
+        i = (i + 1) & (idx->cap - 1);
+    }
+    return NULL; 
+}
+
+void index_put(job_index_t *idx, int key, job_t *job);
+
+void index_grow(job_index_t *idx) {
+    job_slot_t *old = idx->slots; 
+    size_t old_cap = idx->cap; 
+    idx->cap *= 2; 
+    idx->count = 0; 
+    idx->slots = calloc(idx->cap, sizeof(job_slot_t));
+    assert(idx->slots);
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].job) {
+            index_put(idx, old[i].key, old[i].job);
+        }
+    }
+    free(old);
+}
+
+void index_put(job_index_t *idx, int key, job_t *job) {
+    if ((idx->count + 1) * 2 > idx->cap) {
+        index_grow(idx);
+    }
+    size_t i = index_hash(idx, key);
+    while (idx->slots[i].job && idx->slots[i].key != key) {
+        i = (i + 1) & (idx->cap - 1);
+    }
+    if (!idx->slots[i].job) {
+        idx->count++; 
+    }
+    idx->slots[i].key = key; 
+    idx->slots[i].job = job; 
+}
+
+// backward shift deletion, so lookups never need tombstones
+void index_del(job_index_t *idx, int key) {
+    size_t mask = idx->cap - 1; 
+    size_t i = index_hash(idx, key);
+    while (idx->slots[i].job && idx->slots[i].key != key) {
+        i = (i + 1) & mask; 
+    }
+    if (!idx->slots[i].job) {
+        return; 
+    }
+    idx->count--; 
+    size_t j = i; 
+    while (true) {
+        idx->slots[i].job = NULL; 
+        while (true) {
+            j = (j + 1) & mask; 
+            if (!idx->slots[j].job) {
+                return; 
+            }
+            // move slot j back into the hole unless its home lies cyclically in (i, j]
+            size_t home = index_hash(idx, idx->slots[j].key);
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+                continue; 
+            }
+            break; 
+        }
+        idx->slots[i] = idx->slots[j];
+        i = j; 
+    }
+}
+
+job_t *get_last_job(job_list_t *jobs) {
+    return jobs->tail; 
+}
+
+void add_job(job_list_t *jobs, const char *name, pid_t pid){
+    job_t *new_job = pool_get(&job_pool); 
+    new_job->pid = pid; 
+    new_job->suspended = false; 
+    new_job->pidfd = -1; 
+    new_job->exited = false; 
+    new_job->notified = false; 
+    new_job->status = 0; 
+    new_job->pids = NULL; 
+    new_job->npids = 0; 
+    new_job->nlive = 0; 
+    new_job->run = NULL; 
+    new_job->timed = false; 
+    new_job->waited = false; 
+    new_job->heap_idx = -1; 
+    new_job->deadline_sig = SIGTERM; 
+    new_job->kill_after = 0; 
+    new_job->timed_out = false; 
+    new_job->log = NULL; 
+    new_job->cg_fd = -1; 
+    new_job->ctl_waits = 0; 
+    new_job->node = NULL; 
+    new_job->dependents = NULL; 
+    new_job->ndependents = 0; 
+    new_job->scheduled = false; 
+    new_job->cpus = NULL; 
+    new_job->mem_node = -1; 
+    new_job->auto_placed = false; 
+    new_job->niced = false; 
+    new_job->state_slot = -1; 
+    new_job->adopted = false; 
+    memset(&new_job->ru, 0, sizeof(new_job->ru));
+    clock_gettime(CLOCK_MONOTONIC, &new_job->start);
+    new_job->end = new_job->start; 
+    new_job->next_dead = NULL; 
+    new_job->name = name_alloc(name);
+    new_job->jid = ++jobs->curr_jid; 
+    new_job->next = NULL;  
+    new_job->prev = jobs->tail; 
+    if (jobs->tail) {
+        jobs->tail->next = new_job; 
+    } else {
+        jobs->jobs_list = new_job; 
+    }
+    jobs->tail = new_job; 
+    index_put(&jobs->by_jid, new_job->jid, new_job);
+    if (pid > 0) {
+        index_put(&jobs->by_pid, pid, new_job);
+    }
+}
+
+int get_curr_jid(job_list_t *jobs) {
+    return jobs->tail ? jobs->tail->jid : -1; 
+}
+
+// the pidfd wakes the event loop on exit, the exit itself arrives through exit_ring
+void watch_job(job_t *job) {
+    int fd = syscall(SYS_pidfd_open, job->pid, 0);
+    if (fd == -1) {
+        return; 
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_DATA(EV_JOB, job->jid) };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return; 
+    }
+    job->pidfd = fd; 
+}
+
+bool ts_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+struct timespec ts_after(const struct timespec *from, double secs) {
+    struct timespec ts = *from; 
+    ts.tv_sec += (time_t)secs; 
+    ts.tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++; 
+        ts.tv_nsec -= 1000000000L; 
+    }
+    return ts; 
+}
+
+void heap_set(size_t i, job_t *job) {
+    timer_heap[i] = job; 
+    job->heap_idx = i; 
+}
+
+void heap_up(size_t i) {
+    job_t *job = timer_heap[i];
+    while (i > 0 && ts_before(&job->deadline, &timer_heap[(i - 1) / 2]->deadline)) {
+        heap_set(i, timer_heap[(i - 1) / 2]);
+        i = (i - 1) / 2; 
+    }
+    heap_set(i, job);
+}
+
+void heap_down(size_t i) {
+    job_t *job = timer_heap[i];
+    while (true) {
+        size_t c = 2 * i + 1; 
+        if (c >= heap_len) {
+            break; 
+        }
+        if (c + 1 < heap_len && ts_before(&timer_heap[c + 1]->deadline, &timer_heap[c]->deadline)) {
+            c++; 
+        }
+        if (!ts_before(&timer_heap[c]->deadline, &job->deadline)) {
+            break; 
+        }
+        heap_set(i, timer_heap[c]);
+        i = c; 
+    }
+    heap_set(i, job);
+}
+
+// point the one timerfd at whatever is due first, or disarm it
+void timer_arm() {
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    if (heap_len > 0) {
+        its.it_value = timer_heap[0]->deadline; 
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+            its.it_value.tv_nsec = 1; // all zero would disarm
+        }
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// add or move a job's deadline, O(log n); the timerfd is only touched when the earliest one changes
+void set_deadline(job_t *job, struct timespec when) {
+    job_t *first = heap_len ? timer_heap[0] : NULL; 
+    struct timespec old = first ? first->deadline : when; 
+    job->deadline = when; 
+    if (job->heap_idx < 0) {
+        if (heap_len == heap_cap) {
+            heap_cap = heap_cap ? heap_cap * 2 : 16; 
+            timer_heap = realloc(timer_heap, heap_cap * sizeof(job_t *));
+            assert(timer_heap);
+        }
+        heap_set(heap_len++, job);
+    }
+    heap_up(job->heap_idx);
+    heap_down(job->heap_idx);
+    if (timer_heap[0] != first || ts_before(&timer_heap[0]->deadline, &old) || ts_before(&old, &timer_heap[0]->deadline)) {
+        timer_arm();
+    }
+}
+
+void clear_deadline(job_t *job) {
+    if (job->heap_idx < 0) {
+        return; 
+    }
+    size_t i = job->heap_idx; 
+    job->heap_idx = -1; 
+    heap_len--; 
+    if (i < heap_len) {
+        heap_set(i, timer_heap[heap_len]);
+        heap_up(i);
+        heap_down(timer_heap[i]->heap_idx);
+    }
+    if (i == 0) {
+        timer_arm();
+    }
+}
+
+int signal_job(job_t *job, int sig);
+
+// the timerfd went off: signal every job whose deadline has passed
+void fire_timers() {
+    uint64_t ticks; 
+    while (read(timer_fd, &ticks, sizeof(ticks)) > 0);
+    struct timespec now; 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (heap_len > 0 && !ts_before(&now, &timer_heap[0]->deadline)) {
+        job_t *job = timer_heap[0];
+        clear_deadline(job);
+        signal_job(job, job->deadline_sig);
+        if (job->deadline_sig == SIGTERM) {
+            if (job->suspended) {
+                signal_job(job, SIGCONT); // stopped processes only act on SIGTERM once continued
+            }
+            job->timed_out = true; 
+            job->notified = true; 
+            out_printf(STDOUT_FILENO, "[%d] (%d)  timed out  %s\n", job->jid, job->pid, job->name);
+            if (job->kill_after > 0) {
+                job->deadline_sig = SIGKILL; 
+                set_deadline(job, ts_after(&now, job->kill_after));
+            }
+        }
+    }
+    timer_arm();
+}
+
+state_rec_t *state_rec(int slot) {
+    return (state_rec_t *)(state_hdr + 1) + slot; 
+}
+
+// the file and its mapping twice as large, the new slots free
+bool state_grow() {
+    uint32_t old = state_hdr->cap; 
+    uint32_t cap = old ? old * 2 : 64; 
+    size_t size = sizeof(state_hdr_t) + cap * sizeof(state_rec_t);
+    if (ftruncate(state_fd, size) == -1) {
+        return false; 
+    }
+    void *map = mremap(state_hdr, sizeof(state_hdr_t) + old * sizeof(state_rec_t), size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return false; 
+    }
+    state_hdr = map; 
+    state_hdr->cap = cap; 
+    state_free = realloc(state_free, cap * sizeof(uint32_t));
+    assert(state_free);
+    for (uint32_t i = cap; i > old; i--) {
+        state_free[nstate_free++] = i - 1; 
+    }
+    return true; 
+}
+
+// when pid started, in clock ticks since boot, 0 if it is gone
+uint64_t proc_start_ticks(pid_t pid) {
+    char path[32], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0; 
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0; 
+    }
+    buf[n] = '\0'; 
+    // the command name may hold spaces and parens, so count from the last ')': starttime is field 22
+    char *p = strrchr(buf, ')');
+    for (int field = 2; p && field < 22; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    return p ? strtoull(p + 1, NULL, 10) : 0; 
+}
+
+// write job's record in place, taking a slot the first time; nothing else in the file moves
+void state_sync(job_t *job) {
+    if (!state_hdr || job->npids == 0) {
+        return; 
+    }
+    state_rec_t *rec; 
+    if (job->state_slot < 0) {
+        if (nstate_free == 0 && !state_grow()) {
+            return; 
+        }
+        job->state_slot = state_free[--nstate_free]; 
+        rec = state_rec(job->state_slot);
+        rec->start_ticks = proc_start_ticks(job->pid);
+    }
+    rec = state_rec(job->state_slot);
+    // a shell killed halfway through leaves a free slot rather than half a job: the mapping is what
+    // survives it, so the compiler may neither drop the store of 0 nor move the fields past either jid
+    *(volatile int32_t *)&rec->jid = 0; 
+    atomic_signal_fence(memory_order_release);
+    rec->npids = job->npids; 
+    for (int i = 0; i < STATE_PIDS; i++) {
+        rec->pids[i] = i < job->npids ? job->pids[i] : 0; 
+    }
+    rec->suspended = job->suspended; 
+    strncpy(rec->name, job->name, sizeof(rec->name) - 1);
+    rec->name[sizeof(rec->name) - 1] = '\0'; 
+    atomic_signal_fence(memory_order_release);
+    *(volatile int32_t *)&rec->jid = job->jid; 
+    state_hdr->curr_jid = jobs->curr_jid; 
+}
+
+void state_drop(job_t *job) {
+    if (state_hdr && job->state_slot >= 0) {
+        *(volatile int32_t *)&state_rec(job->state_slot)->jid = 0; 
+        state_free[nstate_free++] = job->state_slot; 
+    }
+    job->state_slot = -1; 
+}
+
+void place_release(job_t *job);
+
+void mark_exited(job_t *job) {
+    if (job->exited) {
+        return; 
+    }
+    job->exited = true; 
+    place_release(job);
+    state_drop(job);
+    clear_deadline(job);
+    clock_gettime(CLOCK_MONOTONIC, &job->end);
+    job->next_dead = jobs->dead; 
+    jobs->dead = job; 
+    if (job->waited) {
+        job->waited = false; 
+        wait_remaining--; 
+        if (!wait_next) {
+            wait_next = job; 
+        }
+    }
+    if (job->pidfd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, job->pidfd, NULL);
+    }
+}
+
+// small control files, read and written whole
+ssize_t cg_read(int dir, const char *file, char *buf, size_t size) {
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1; 
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0'; 
+    return n; 
+}
+
+bool cg_write(int dir, const char *file, const char *val) {
+    int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false; 
+    }
+    ssize_t n = write(fd, val, strlen(val));
+    int saved_errno = errno; 
+    close(fd);
+    errno = saved_errno; 
+    return n == (ssize_t)strlen(val); 
+}
+
+// turn on what we can of cpu, memory and pids for dir's children
+void cg_delegate(int dir) {
+    char avail[256];
+    if (cg_read(dir, "cgroup.controllers", avail, sizeof(avail)) <= 0) {
+        return; 
+    }
+    const char *wanted[] = { "cpu", "memory", "pids" };
+    for (int i = 0; i < 3; i++) {
+        char *at = strstr(avail, wanted[i]);
+        size_t len = strlen(wanted[i]);
+        if (at && (at == avail || at[-1] == ' ') && (at[len] == ' ' || at[len] == '\n' || at[len] == '\0')) {
+            char val[16];
+            snprintf(val, sizeof(val), "+%s", wanted[i]);
+            cg_write(dir, "cgroup.subtree_control", val);
+        }
+    }
+}
+
+// drop the job cgroups that emptied out after their jobs were gone, then our own
+void cgroup_cleanup() {
+    DIR *d = fdopendir(dup(cg_root));
+    if (d) {
+        struct dirent *e; 
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_type == DT_DIR && strncmp(e->d_name, "job", 3) == 0) {
+                unlinkat(cg_root, e->d_name, AT_REMOVEDIR);
+            }
+        }
+        closedir(d);
+    }
+    rmdir(cg_path);
+}
+
+// find the cgroup2 mount and the shell's cgroup in it, and make crash-<pid> below that for the jobs;
+// on a v1-only or read-only hierarchy say why once and return false from then on
+bool cgroup_init() {
+    if (cg_state != 0) {
+        return cg_state > 0; 
+    }
+    cg_state = -1; 
+    char mnt[PATH_MAX] = "", root[PATH_MAX] = "", rel[PATH_MAX] = "";
+    char *line = NULL; 
+    size_t cap = 0; 
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+    while (f && getline(&line, &cap, f) > 0) {
+        if (strstr(line, " - cgroup2 ") && sscanf(line, "%*d %*d %*s %4095s %4095s", root, mnt) == 2) {
+            break; 
+        }
+        mnt[0] = '\0'; 
+    }
+    if (f) {
+        fclose(f);
+    }
+    f = fopen("/proc/self/cgroup", "re");
+    while (f && getline(&line, &cap, f) > 0) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0'; 
+            snprintf(rel, sizeof(rel), "%s", line + 3);
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    free(line);
+    if (mnt[0] == '\0' || rel[0] == '\0') {
+        out_puts(STDERR_FILENO, "ERROR: no cgroup v2 hierarchy, jobs run without cgroups\n");
+        return false; 
+    }
+    // a bind mount of a subtree shows its root in mountinfo, and our path includes it
+    size_t skip = strcmp(root, "/") != 0 && strncmp(rel, root, strlen(root)) == 0 ? strlen(root) : 0; 
+    snprintf(cg_path, sizeof(cg_path), "%s%s", mnt, strcmp(rel + skip, "/") == 0 ? "" : rel + skip);
+    int parent = open(cg_path, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    size_t len = strlen(cg_path);
+    snprintf(cg_path + len, sizeof(cg_path) - len, "/crash-%d", getpid());
+    if (parent == -1 || (mkdir(cg_path, 0755) == -1 && errno != EEXIST)
+        || (cg_root = open(cg_path, O_DIRECTORY | O_RDONLY | O_CLOEXEC)) == -1) {
+        out_printf(STDERR_FILENO, "ERROR: cannot make %s: %s, jobs run without cgroups\n", cg_path, strerror(errno));
+        if (parent != -1) {
+            close(parent);
+        }
+        return false; 
+    }
+    // the parent may refuse (it has processes of its own), then limits are what it already hands down
+    cg_delegate(parent);
+    cg_delegate(cg_root);
+    close(parent);
+    if (cg_read(cg_root, "cgroup.subtree_control", cg_controllers, sizeof(cg_controllers)) < 0) {
+        cg_controllers[0] = '\0'; 
+    }
+    cg_controllers[strcspn(cg_controllers, "\n")] = '\0'; 
+    atexit(cgroup_cleanup);
+    cg_state = 1; 
+    return true; 
+}
+
+// write one limit into the job's cgroup; a missing controller only costs the limit, not the job
+void cgroup_limit(job_t *job, const char *file, const char *val) {
+    if (!cg_write(job->cg_fd, file, val)) {
+        out_printf(STDERR_FILENO, "ERROR: cannot set %s for job %d: %s\n", file, job->jid,
+                 errno == ENOENT ? "controller not delegated here" : strerror(errno));
+    }
+}
+
+// a fresh cgroup for job below cg_root with opts' limits in place before anything joins it
+bool cgroup_attach(job_t *job, const job_opts_t *opts) {
+    char name[32], val[64];
+    snprintf(name, sizeof(name), "job%lu", ++cg_seq);
+    if (mkdirat(cg_root, name, 0755) == -1 && errno != EEXIST) {
+        out_printf(STDERR_FILENO, "ERROR: cannot make a cgroup for job %d: %s\n", job->jid, strerror(errno));
+        return false; 
+    }
+    job->cg_fd = openat(cg_root, name, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    job->cg_id = cg_seq; 
+    if (job->cg_fd == -1) {
+        unlinkat(cg_root, name, AT_REMOVEDIR);
+        return false; 
+    }
+    if (opts && opts->cpus > 0) {
+        snprintf(val, sizeof(val), "%ld 100000", (long)(opts->cpus * 100000 + 0.5));
+        cgroup_limit(job, "cpu.max", val);
+    }
+    if (opts && opts->mem_max > 0) {
+        snprintf(val, sizeof(val), "%lld", opts->mem_max);
+        cgroup_limit(job, "memory.max", val);
+    }
+    if (opts && opts->pids_max > 0) {
+        snprintf(val, sizeof(val), "%ld", opts->pids_max);
+        cgroup_limit(job, "pids.max", val);
+    }
+    return true; 
+}
+
+// the job is gone; its cgroup goes too unless something it started is still in there
+void cgroup_detach(job_t *job) {
+    char name[32];
+    snprintf(name, sizeof(name), "job%lu", job->cg_id);
+    close(job->cg_fd);
+    job->cg_fd = -1; 
+    unlinkat(cg_root, name, AT_REMOVEDIR);
+}
+
+// "some avg10=" of a pressure file, the share of the last 10s some task in the cgroup was stalled
+double cg_pressure(int dir, const char *file) {
+    char buf[256];
+    double avg10 = 0; 
+    if (cg_read(dir, file, buf, sizeof(buf)) > 0) {
+        sscanf(buf, "some avg10=%lf", &avg10);
+    }
+    return avg10; 
+}
+
+// jobs -l for a job with a cgroup: cpu over the whole tree, memory if accounted, and pressure
+void print_cgroup_usage(job_t *job) {
+    char buf[512];
+    if (cg_read(job->cg_fd, "cpu.stat", buf, sizeof(buf)) > 0) {
+        unsigned long long usec = 0; 
+        sscanf(buf, "usage_usec %llu", &usec);
+        out_printf(STDOUT_FILENO, "cg cpu %.3fs  ", usec / 1e6);
+    }
+    if (cg_read(job->cg_fd, "memory.current", buf, sizeof(buf)) > 0) {
+        out_printf(STDOUT_FILENO, "cg mem %lldKB  ", atoll(buf) / 1024);
+    }
+    out_printf(STDOUT_FILENO, "psi cpu %.2f%% mem %.2f%%  ", cg_pressure(job->cg_fd, "cpu.pressure"),
+             cg_pressure(job->cg_fd, "memory.pressure"));
+}
+
+void sched_cancel(job_t *job, int status);
+
+// the whole process group, so whatever the job's processes started goes too;
+// the leader's pidfd pins the group's struct pid, so a recycled group id is never hit
+int signal_job(job_t *job, int sig) {
+    if (job->node) {
+        // not started yet: whatever would end it cancels it instead, stopping or continuing is moot
+        if (sig != 0 && sig != SIGCONT && sig != SIGSTOP && sig != SIGTSTP) {
+            sched_cancel(job, sig); // the wait status of being killed by sig
+        }
+        return 0; 
+    }
+    // cgroup.kill (Linux 5.14) takes everything in the cgroup at once, even what left the group
+    if (sig == SIGKILL && job->cg_fd != -1 && cg_write(job->cg_fd, "cgroup.kill", "1")) {
+        return 0; 
+    }
+    if (job->pidfd != -1) {
+        int ret = syscall(SYS_pidfd_send_signal, job->pidfd, sig, NULL, PIDFD_SIGNAL_PROCESS_GROUP);
+        if (ret == 0 || errno != EINVAL) {
+            return ret; 
+        }
+    }
+    // before Linux 6.9: the group id is not reused while any stage is unreaped
+    if (job->nlive > 0) {
+        return kill(-job->pid, sig);
+    }
+    errno = ESRCH; 
+    return -1; 
+}
+
+// the first pid added becomes the job's pid, later ones are further pipeline stages
+void add_pid(job_t *last_job, pid_t pid){
+    if (last_job->npids == 0) {
+        if (index_get(&jobs->by_pid, last_job->pid) == last_job) {
+            index_del(&jobs->by_pid, last_job->pid);
+        }
+        last_job->pid = pid; 
+    }
+    if (last_job->npids == 0) {
+        last_job->pids = &last_job->pid1; 
+    } else {
+        pid_t *pids = malloc((last_job->npids + 1) * sizeof(pid_t));
+        assert(pids);
+        memcpy(pids, last_job->pids, last_job->npids * sizeof(pid_t));
+        if (last_job->pids != &last_job->pid1) {
+            free(last_job->pids);
+        }
+        last_job->pids = pids; 
+    }
+    last_job->pids[last_job->npids++] = pid; 
+    last_job->nlive++; 
+    index_put(&jobs->by_pid, pid, last_job);
+    if (last_job->npids == 1) {
+        watch_job(last_job);
+    }
+    state_sync(last_job);
+}
+
+void set_job_suspended(job_t *job, bool suspended) {
+    if (job->suspended != suspended) {
+        jobs->n_suspended += suspended ? 1 : -1; 
+    }
+    job->suspended = suspended; 
+    if (job->state_slot >= 0) {
+        state_sync(job);
+    }
+}
+
+void joblog_release(joblog_t *log);
+int job_wait_status(job_t *job);
+
+void remove_job(job_list_t *jobs, job_t *job) {
+    clear_deadline(job);
+    if (job->exited) {
+        done_ring[job->jid % DONE_KEEP].jid = job->jid; 
+        done_ring[job->jid % DONE_KEEP].status = job_wait_status(job);
+    }
+    free(job->dependents);
+    place_release(job);
+    free(job->cpus);
+    if (job->log) {
+        joblog_release(job->log);
+    }
+    if (job->cg_fd != -1) {
+        cgroup_detach(job);
+    }
+    if (job->prev) {
+        job->prev->next = job->next; 
+    } else {
+        jobs->jobs_list = job->next; 
+    }
+    if (job->next) {
+        job->next->prev = job->prev; 
+    } else {
+        jobs->tail = job->prev; 
+    }
+    index_del(&jobs->by_jid, job->jid);
+    if (index_get(&jobs->by_pid, job->pid) == job) {
+        index_del(&jobs->by_pid, job->pid);
+    }
+    for (int i = 0; i < job->npids; i++) {
+        if (index_get(&jobs->by_pid, job->pids[i]) == job) {
+            index_del(&jobs->by_pid, job->pids[i]);
+        }
+    }
+    if (job->pids != &job->pid1) {
+        free(job->pids);
+    }
+    set_job_suspended(job, false);
+    if (job->pidfd != -1) {
+        close(job->pidfd);
+    }
+    name_free(job->name);
+    pool_put(&job_pool, job);
+}
+
+void free_job_list(job_list_t *jobs) {
+    job_t *curr = jobs->jobs_list; 
+    while (curr) {
+        job_t *temp = curr; 
+        curr = curr->next; 
+        name_free(temp->name); 
+        if (temp->pids != &temp->pid1) {
+            free(temp->pids);
+        }
+        pool_put(&job_pool, temp);
+    }
+    free(jobs->by_jid.slots);
+    free(jobs->by_pid.slots);
+    free(jobs);
+}
+
+int wait_events(int timeout);
+
+// drop reaped jobs, costs O(exits) rather than O(jobs)
+void clean_jobs() {
+    uint64_t t0 = stats_on ? now_ns() : 0; 
+    while (wait_events(0) > 0);
+    while (jobs->dead) {
+        job_t *temp = jobs->dead; 
+        jobs->dead = temp->next_dead; 
+        remove_job(jobs, temp);
+        stat_cleaned++; 
+    }
+    if (stats_on) {
+        hist_record(&hist_clean, now_ns() - t0);
+    }
+}
+
+// drop one reaped job ahead of clean_jobs()
+void drop_job(job_t *job) {
+    job_t **link = &jobs->dead; 
+    while (*link && *link != job) {
+        link = &(*link)->next_dead; 
+    }
+    if (*link) {
+        *link = job->next_dead; 
+        remove_job(jobs, job);
+    }
+}
+
+int get_jid(pid_t cpid) {
+    if (jobs == NULL) {
+        return -1; 
+    }
+    job_t *curr = index_get(&jobs->by_pid, cpid);
+    return curr ? curr->jid : -1; 
+}
+
+char *get_name(pid_t cpid) {
+    if (jobs == NULL)
+        return NULL;
+    job_t *curr = index_get(&jobs->by_pid, cpid);
+    return curr ? curr->name : NULL; 
+}
+
+job_t *get_job_jid(int jid) {
+    if (jobs == NULL) {
+        return NULL; 
+    }
+    return index_get(&jobs->by_jid, jid);
+}
+
+job_t *get_job_pid(int pid) {
+    if (jobs == NULL) {
+        return NULL; 
+    }
+    return index_get(&jobs->by_pid, pid);
+}
+
+void print_jobs() {
+    job_t *curr = jobs->jobs_list;
+    while (curr) {
+        printf("\tmem addr: %p, jid: %d, pid: %d, name: %s, next: %p, suspended: %d\n", curr, curr->jid, curr->pid, curr->name, curr->next, curr->suspended);
+        curr = curr->next; 
+    }
+}
+
+void set_suspended(pid_t pid) {
+    job_t *curr = get_job_pid(pid); 
+    set_job_suspended(curr, true);
+}
+
+bool jobs_full() {
+    clean_jobs();
+    return (jobs->n_suspended >= 32); 
+}
+
+// shell-style exit code: the exit status, or 128 + the signal that ended or stopped it
+int status_code(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// how a job ended, as wait4 would have said it, a timeout as exit 124
+int job_wait_status(job_t *job) {
+    return job->timed_out ? 124 << 8 : job->status; 
+}
+
+// how a job ended, as the shell reports it
+int job_exit_code(job_t *job) {
+    return status_code(job_wait_status(job));
+}
+
+double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9; 
+}
+
+// the `time` report, from the rusage wait4 collected for every stage
+void print_times(job_t *job) {
+    out_printf(STDERR_FILENO, "[%d] (%d)  real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB  exit %d  %s\n",
+             job->jid, job->pid, elapsed(&job->start, &job->end),
+             job->ru.ru_utime.tv_sec + job->ru.ru_utime.tv_usec / 1e6,
+             job->ru.ru_stime.tv_sec + job->ru.ru_stime.tv_usec / 1e6,
+             job->ru.ru_maxrss, job_exit_code(job), job->name);
+}
+
+// cpu seconds and resident KB of a live process, from /proc/<pid>/stat
+bool proc_usage(pid_t pid, double *cpu, long *rss_kb) {
+    char path[32], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false; 
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return false; 
+    }
+    buf[n] = '\0'; 
+    // comm may contain spaces, so count fields from the last ')'; utime is field 14, rss field 24
+    char *p = strrchr(buf, ')');
+    if (!p) {
+        return false; 
+    }
+    unsigned long utime, stime; 
+    long rss; 
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+               &utime, &stime, &rss) != 3) {
+        return false; 
+    }
+    *cpu += (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    *rss_kb += rss * (sysconf(_SC_PAGESIZE) / 1024);
+    return true; 
+}
+
+
+void print_status(pid_t p1, const char* name) {
+    job_t *job = get_job_pid(p1);
+    if (flag_c) {
+        last_status = 128 + SIGINT; 
+    } else if (flag_q) {
+        last_status = 128 + SIGQUIT; 
+    } else if (flag_z) {
+        last_status = 128 + SIGTSTP; 
+    } else {
+        last_status = job_exit_code(job);
+    }
+    if (flag_c) {
+        signal_job(job, SIGINT); 
+        job->notified = true; 
+        out_printf(STDOUT_FILENO, "[%d] (%d)  killed  %s\n", get_jid(p1), p1, name);
+        flag_c = false; 
+    } else if (flag_q) {
+        signal_job(job, SIGQUIT); 
+        job->notified = true; 
+        out_printf(STDOUT_FILENO, "[%d] (%d)  killed  %s\n", get_jid(p1), p1, name);
+        flag_q = false; 
+    } else if(flag_z) {
+        signal_job(job, SIGTSTP); 
+        out_printf(STDOUT_FILENO, "[%d] (%d)  suspended  %s\n", get_jid(p1), p1, name);
+        flag_z = false;
+        set_suspended(p1);
+    } else {
+        if (!job->notified) { // a timeout already said how it ended
+            job->notified = true; 
+            out_printf(STDOUT_FILENO, "[%d] (%d)  finished  %s\n", get_jid(p1), p1, name);
+        }
+        if (job->timed) {
+            print_times(job);
+        }
+    }
+}
+
+void handle_sigint_sigtstp_sigquit(int sig, siginfo_t *info, void *context);
+
+void init_events() {
+    sigemptyset(&wait_mask);
+    sigaddset(&wait_mask, SIGCHLD);
+    sigaddset(&wait_mask, SIGINT);
+    sigaddset(&wait_mask, SIGTSTP);
+    sigaddset(&wait_mask, SIGQUIT);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    sigfd = signalfd(-1, &wait_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (epfd == -1 || sigfd == -1 || pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        out_printf(STDERR_FILENO, "ERROR: %s\n", strerror(errno));
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_DATA(EV_SIGNAL, 0) };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+    ev.data.u64 = EV_DATA(EV_WAKE, 0);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_pipe[0], &ev);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd != -1) {
+        ev.data.u64 = EV_DATA(EV_TIMER, 0);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+    }
+}
+
+joblog_t *joblog_find(int jid) {
+    size_t lo = 0, hi = nlogs; 
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2; 
+        if (logs[mid]->jid < jid) {
+            lo = mid + 1; 
+        } else {
+            hi = mid; 
+        }
+    }
+    return lo < nlogs && logs[lo]->jid == jid ? logs[lo] : NULL; 
+}
+
+// a log and the pipe feeding it for job jid, NULL if either can't be had; *wfd gets the write end
+joblog_t *joblog_new(int jid, int *wfd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        return NULL; 
+    }
+    char *buf = mmap(NULL, log_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (buf == MAP_FAILED) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL; 
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    joblog_t *log = malloc(sizeof(joblog_t));
+    assert(log);
+    *log = (joblog_t){ jid, buf, log_size, 0, fds[0], false };
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_DATA(EV_LOG, jid) };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev);
+    if (nlogs == logs_cap) {
+        logs_cap = logs_cap ? logs_cap * 2 : 16; 
+        logs = realloc(logs, logs_cap * sizeof(joblog_t *));
+        assert(logs);
+    }
+    logs[nlogs++] = log; // jids only grow, so this keeps logs sorted
+    *wfd = fds[1]; 
+    return log; 
+}
+
+void joblog_close(joblog_t *log) {
+    if (log->fd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, log->fd, NULL);
+        close(log->fd);
+        log->fd = -1; 
+    }
+}
+
+void joblog_free(joblog_t *log) {
+    joblog_close(log);
+    munmap(log->buf, log->cap);
+    size_t i = 0; 
+    while (i < nlogs && logs[i] != log) {
+        i++; 
+    }
+    if (i < nlogs) {
+        memmove(&logs[i], &logs[i + 1], (nlogs - i - 1) * sizeof(joblog_t *));
+        nlogs--; 
+    }
+    free(log);
+}
+
+// the job is gone: keep its log around for joblog, dropping the oldest done ones past LOG_KEEP
+void joblog_release(joblog_t *log) {
+    log->done = true; 
+    size_t ndone = 0; 
+    for (size_t i = 0; i < nlogs; i++) {
+        ndone += logs[i]->done; 
+    }
+    for (size_t i = 0; i < nlogs && ndone > LOG_KEEP; ) {
+        if (logs[i]->done) {
+            // a grandchild may still hold the pipe; closing it just gets that one EPIPE
+            joblog_free(logs[i]);
+            ndone--; 
+        } else {
+            i++; 
+        }
+    }
+}
+
+// pipe to ring, straight into the mapping with no copy in between
+void joblog_read(joblog_t *log) {
+    while (log->fd != -1) {
+        size_t pos = log->written % log->cap; 
+        ssize_t n = read(log->fd, log->buf + pos, log->cap - pos);
+        if (n > 0) {
+            log->written += n; 
+        } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+            joblog_close(log);
+        } else if (errno == EAGAIN) {
+            break; 
+        }
+    }
+}
+
+// queue what the ring still holds from byte offset from on, returns the new offset
+uint64_t joblog_print(joblog_t *log, uint64_t from) {
+    if (log->written > log->cap && from < log->written - log->cap) {
+        from = log->written - log->cap; // overwritten already
+    }
+    while (from < log->written) {
+        size_t pos = from % log->cap; 
+        size_t len = log->cap - pos; 
+        if (len > log->written - from) {
+            len = log->written - from; 
+        }
+        out_write(STDOUT_FILENO, log->buf + pos, len);
+        from += len; 
+    }
+    return from; 
+}
+
+// async-signal-safe: only wait4, atomics and write
+void reap_children() {
+    int saved_errno = errno; 
+    while (true) {
+        unsigned head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        if (head - atomic_load_explicit(&ring_tail, memory_order_acquire) == EXIT_RING_SIZE) {
+            // leave the rest as zombies, drain_exits() comes back for them
+            ring_overflow = 1; 
+            break; 
+        }
+        exit_rec_t *rec = &exit_ring[head % EXIT_RING_SIZE];
+        pid_t pid = wait4(-1, &rec->status, WNOHANG, &rec->ru);
+        if (pid <= 0) {
+            break; 
+        }
+        rec->pid = pid; 
+        // from the handler nobody heard of it before now
+        rec->heard_ns = !stats_on ? 0 : exit_heard_ns ? exit_heard_ns : now_ns(); 
+        atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+    }
+    write(wake_pipe[1], "", 1);
+    errno = saved_errno; 
+}
+
+void parallel_task_done(job_t *job);
+void ctl_job_done(job_t *job);
+void sched_job_done(job_t *job);
+void finish_job(job_t *job);
+
+void print_exit(job_t *job) {
+    if (WIFSIGNALED(job->status)) {
+        int sig = WTERMSIG(job->status);
+        if (sig == SIGQUIT || sig == SIGSEGV) {
+            out_printf(STDOUT_FILENO, "[%d] (%d)  killed (core dumped)  %s\n", job->jid, job->pid, job->name);
+        } else if (sig == SIGKILL){
+            
+        } else {
+            out_printf(STDERR_FILENO, "[%d] (%d)  killed  %s\n", job->jid, job->pid, job->name);
+        }
+    } else {
+        out_printf(STDOUT_FILENO, "[%d] (%d)  finished  %s\n", job->jid, job->pid, job->name);
+    }
+}
+
+void handle_exit(exit_rec_t *rec) {
+    if (stats_on && rec->heard_ns) {
+        stat_reaped++; 
+        hist_record(&hist_reap, now_ns() - rec->heard_ns);
+    }
+    job_t *job = get_job_pid(rec->pid);
+    if (!job) {
+        // with subreaper on, something a job left behind
+        orphans_reaped += subreaper_mode; 
+        return; 
+    }
+    // like other shells, a pipeline ends with the status of its last stage
+    if (job->npids == 0 || rec->pid == job->pids[job->npids - 1]) {
+        job->status = rec->status; 
+    }
+    timeradd(&job->ru.ru_utime, &rec->ru.ru_utime, &job->ru.ru_utime);
+    timeradd(&job->ru.ru_stime, &rec->ru.ru_stime, &job->ru.ru_stime);
+    if (rec->ru.ru_maxrss > job->ru.ru_maxrss) {
+        job->ru.ru_maxrss = rec->ru.ru_maxrss; 
+    }
+    if (--job->nlive > 0) {
+        return; 
+    }
+    finish_job(job);
+}
+
+// job's last stage is gone: report it and tell whatever waits on it
+void finish_job(job_t *job) {
+    mark_exited(job);
+    if (job != fg_job) {
+        if (!job->notified) {
+            job->notified = true; 
+            print_exit(job);
+        }
+        if (job->timed) {
+            print_times(job);
+        }
+    }
+    if (job->run) {
+        parallel_task_done(job);
+    }
+    if (job->ctl_waits > 0) {
+        ctl_job_done(job);
+    }
+    if (job->ndependents > 0 || job->scheduled) {
+        sched_job_done(job);
+    }
+}
+
+// an adopted job's watched stage ended: watch the next one still in its group, and when none is
+// left the job is over. Its exit status went to its new parent, so it ends as 0
+void adopted_exit(job_t *job) {
+    if (job->pidfd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, job->pidfd, NULL);
+        close(job->pidfd);
+        job->pidfd = -1; 
+    }
+    job->nlive--; 
+    while (job->nlive > 0) {
+        pid_t pid = job->pids[job->npids - job->nlive]; 
+        int fd = syscall(SYS_pidfd_open, pid, 0);
+        // checked after opening: the pidfd pins the process, the group says it is still ours
+        if (fd != -1 && getpgid(pid) == job->pid) {
+            struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_DATA(EV_JOB, job->jid) };
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            job->pidfd = fd; 
+            return; 
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        job->nlive--; 
+    }
+    job->status = 0; 
+    finish_job(job);
+}
+
+// apply every queued exit to the job table, in batches
+void drain_exits() {
+    char junk[64];
+    while (read(wake_pipe[0], junk, sizeof(junk)) > 0);
+    while (true) {
+        unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&ring_head, memory_order_acquire);
+        if (tail == head) {
+            if (!ring_overflow && !reap_pending) {
+                break; 
+            }
+            // SIGCHLD came through sigfd, or children were left unreaped while the ring was full
+            sigset_t old; 
+            sigprocmask(SIG_BLOCK, &wait_mask, &old);
+            ring_overflow = 0; 
+            reap_pending = false; 
+            reap_children();
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            while (read(wake_pipe[0], junk, sizeof(junk)) > 0);
+            continue; 
+        }
+        for (; tail != head; tail++) {
+            handle_exit(&exit_ring[tail % EXIT_RING_SIZE]);
+        }
+        atomic_store_explicit(&ring_tail, tail, memory_order_release);
+    }
+    exit_heard_ns = 0; 
+}
+
+// signals in wait_mask only reach sigfd while they are blocked
+void read_signals() {
+    struct signalfd_siginfo si;
+    while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD) {
+            if (stats_on && !exit_heard_ns) {
+                exit_heard_ns = now_ns(); 
+            }
+            reap_pending = true; 
+        } else {
+            handle_sigint_sigtstp_sigquit(si.ssi_signo, NULL, NULL);
+        }
+    }
+}
+
+void ctl_accept();
+void ctl_event(int slot, uint32_t events);
+void ctl_resume_all();
+void stats_dump();
+
+// block until something happens or timeout ms pass (-1 waits forever), returns the number of events
+int wait_events(int timeout) {
+    struct epoll_event evs[64];
+    if (timeout != 0) {
+        out_flush(); // about to block, so let the user see what we have
+    }
+    int n = epoll_wait(epfd, evs, 64, timeout);
+    for (int i = 0; i < n; i++) {
+        uint64_t tag = evs[i].data.u64 >> 32; 
+        int id = (int)(uint32_t)evs[i].data.u64; 
+        if (tag == EV_SIGNAL) {
+            read_signals();
+        } else if (tag == EV_JOB) {
+            // exited, but not necessarily reaped while SIGCHLD is blocked
+            job_t *job = get_job_jid(id);
+            if (job && job->adopted) {
+                // not our child, nothing to reap
+                adopted_exit(job);
+                continue; 
+            }
+            if (job && job->pidfd != -1) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, job->pidfd, NULL);
+            }
+            if (stats_on && !exit_heard_ns) {
+                exit_heard_ns = now_ns(); 
+            }
+            reap_pending = true; 
+        } else if (tag == EV_INPUT) {
+            input_ready = true; 
+        } else if (tag == EV_TIMER) {
+            fire_timers();
+        } else if (tag == EV_LOG) {
+            joblog_t *log = joblog_find(id);
+            if (log) {
+                joblog_read(log);
+            }
+        } else if (tag == EV_CTL) {
+            ctl_accept();
+        } else if (tag == EV_CLIENT) {
+            ctl_event(id, evs[i].events);
+        } else if (tag == EV_STATS) {
+            stats_dump();
+        }
+    }
+    drain_exits();
+    if (ctl_resume) {
+        ctl_resume_all();
+    }
+    return n; 
+}
+
+// sleep until the foreground job is reaped or one of flag_c/flag_q/flag_z gets set
+void wait_fg(job_t *job, int *status) {
+    sigset_t old; 
+    sigprocmask(SIG_BLOCK, &wait_mask, &old);
+    fg_job = job; 
+    reap_pending = true; 
+    drain_exits();
+    while (!job->exited && flag_c == false && flag_q == false && flag_z == false) {
+        wait_events(-1);
+    }
+    fg_job = NULL; 
+    *status = job->status; 
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+size_t path_hash(const char *name) {
+    size_t h = 14695981039346656037ULL; 
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 1099511628211ULL; 
+    }
+    return h; 
+}
+
+void path_cache_clear() {
+    for (size_t i = 0; i < path_cache.cap; i++) {
+        free(path_cache.slots[i].name);
+        free(path_cache.slots[i].path);
+    }
+    free(path_cache.slots);
+    path_cache.cap = 64; 
+    path_cache.count = 0; 
+    path_cache.slots = calloc(path_cache.cap, sizeof(path_slot_t));
+    assert(path_cache.slots);
+}
+
+path_slot_t *path_cache_slot(const char *name) {
+    size_t i = path_hash(name) & (path_cache.cap - 1);
+    while (path_cache.slots[i].name && strcmp(path_cache.slots[i].name, name) != 0) {
+        i = (i + 1) & (path_cache.cap - 1);
+    }
+    return &path_cache.slots[i];
+}
+
+void path_cache_put(const char *name, const char *path) {
+    if ((path_cache.count + 1) * 2 > path_cache.cap) {
+        path_slot_t *old = path_cache.slots; 
+        size_t old_cap = path_cache.cap; 
+        path_cache.cap *= 2; 
+        path_cache.slots = calloc(path_cache.cap, sizeof(path_slot_t));
+        assert(path_cache.slots);
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].name) {
+                *path_cache_slot(old[i].name) = old[i];
+            }
+        }
+        free(old);
+    }
+    path_slot_t *slot = path_cache_slot(name);
+    if (slot->name) {
+        free(slot->path);
+    } else {
+        slot->name = strdup(name);
+        slot->hits = 0; 
+        path_cache.count++; 
+    }
+    slot->path = strdup(path);
+    assert(slot->name && slot->path);
+}
+
+void path_cache_del(const char *name) {
+    path_slot_t *slot = path_cache_slot(name);
+    if (!slot->name) {
+        return; 
+    }
+    free(slot->name);
+    free(slot->path);
+    slot->name = NULL; 
+    path_cache.count--; 
+    // reinsert the rest of the probe run so lookups don't stop at the hole
+    size_t i = (slot - path_cache.slots + 1) & (path_cache.cap - 1);
+    while (path_cache.slots[i].name) {
+        path_slot_t moved = path_cache.slots[i];
+        path_cache.slots[i].name = NULL; 
+        *path_cache_slot(moved.name) = moved; 
+        i = (i + 1) & (path_cache.cap - 1);
+    }
+}
+
+// drop everything if $PATH changed since the entries were resolved
+void path_cache_check() {
+    const char *env = getenv("PATH");
+    if (!env) {
+        env = ""; 
+    }
+    if (path_cache.slots && path_cache.path_env && strcmp(path_cache.path_env, env) == 0) {
+        return; 
+    }
+    path_cache_clear();
+    free(path_cache.path_env);
+    path_cache.path_env = strdup(env);
+    assert(path_cache.path_env);
+}
+
+// absolute path for a command name the way execvp would find it, NULL if there is none
+const char *resolve_cmd(const char *name) {
+    if (strchr(name, '/')) {
+        return name; 
+    }
+    path_cache_check();
+    path_slot_t *slot = path_cache_slot(name);
+    if (slot->name) {
+        slot->hits++; 
+        return slot->path; 
+    }
+    const char *dir = path_cache.path_env; 
+    size_t name_len = strlen(name);
+    while (true) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir; 
+        char cand[dir_len + name_len + 3];
+        // an empty $PATH entry means the current directory
+        if (dir_len == 0) {
+            strcpy(cand, "./");
+        } else {
+            memcpy(cand, dir, dir_len);
+            cand[dir_len] = '/'; 
+            cand[dir_len + 1] = '\0'; 
+        }
+        strcat(cand, name);
+        struct stat st; 
+        if (access(cand, X_OK) == 0 && stat(cand, &st) == 0 && S_ISREG(st.st_mode)) {
+            path_cache_put(name, cand);
+            slot = path_cache_slot(name);
+            slot->hits++; 
+            return slot->path; 
+        }
+        if (*end == '\0') {
+            return NULL; 
+        }
+        dir = end + 1; 
+    }
+}
+
+// the original launcher, still used when CRASH_SPAWN=fork and for jobs with a child setup to do
+pid_t fork_cmd(const char **argv, pid_t pgid, int in_fd, int out_fd, int err_fd, const child_setup_t *setup, struct sigaction *act_fg) {
+    // looked up here, so the cache the next launch sees is the shell's and not a dead child's copy
+    const char *path = resolve_cmd(argv[0]);
+    pid_t p1 = fork(); 
+    if (p1 == 0) {
+        if (setup && setup->cg_fd != -1) {
+            // join before exec, so nothing the command starts is ever outside the cgroup
+            int procs = openat(setup->cg_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+            if (procs != -1) {
+                write(procs, "0", 1);
+                close(procs);
+            }
+        }
+        // all three are inherited across exec and by whatever the command starts
+        if (setup && setup->cpus) {
+            sched_setaffinity(0, sizeof(cpu_set_t), setup->cpus);
+        }
+        if (setup && setup->mpol) {
+            syscall(SYS_set_mempolicy, setup->mpol, &setup->mems, sizeof(setup->mems) * 8 + 1);
+        }
+        if (setup && setup->set_nice) {
+            setpriority(PRIO_PROCESS, 0, setup->nice);
+        }
+        sigaction(SIGINT, act_fg, NULL);
+        // SIGINT and friends are blocked too when a task starts from inside the event loop
+        sigprocmask(SIG_UNBLOCK, &wait_mask, NULL); 
+        int bandage = errno; 
+        setpgid(0, pgid);
+        errno = bandage; 
+        if (in_fd != -1) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != -1) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        if (err_fd != -1) {
+            dup2(err_fd, STDERR_FILENO);
+        }
+        if (path) {
+            execv(path, (char *const *) argv);
+        }
+        // not found, or a stale or unrunnable cache entry: search $PATH afresh as execvp does
+        int error = path == argv[0] ? -1 : execvp(argv[0], (char *const *) argv);
+        if (error == -1) {
+            char err[50]; 
+            snprintf(err, sizeof(err), "ERROR: cannot run %s\n", argv[0]);
+            write(STDERR_FILENO, err, strlen(err));
+            _exit(1); // will definitely cause problems but works for now
+        }
+    }
+    return p1; 
+}
+
+// start argv in process group pgid (0 for a new group) with the given stdin/stdout/stderr (-1 to inherit),
+// set up as setup says if not NULL; returns the pid or -1 with errno set, an exec failure included
+pid_t spawn_cmd(const char **argv, pid_t pgid, int in_fd, int out_fd, int err_fd, const child_setup_t *setup, struct sigaction *act_fg) {
+    const char *mode = getenv("CRASH_SPAWN");
+    if (setup || (mode && strcmp(mode, "fork") == 0)) {
+        return fork_cmd(argv, pgid, in_fd, out_fd, err_fd, setup, act_fg);
+    }
+    // glibc implements posix_spawn with clone(CLONE_VM | CLONE_VFORK), so no page tables get copied
+    posix_spawnattr_t attr; 
+    posix_spawn_file_actions_t fa; 
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&fa);
+
+    // same child setup as fork_cmd: own group, SIGINT and friends default and unblocked
+    sigset_t mask, defaults; 
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    sigdelset(&mask, SIGINT);
+    sigdelset(&mask, SIGTSTP);
+    sigdelset(&mask, SIGQUIT);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+    }
+    if (err_fd != -1) {
+        posix_spawn_file_actions_adddup2(&fa, err_fd, STDERR_FILENO);
+    }
+
+    pid_t pid; 
+    int error = ENOENT; 
+    const char *path = resolve_cmd(argv[0]);
+    if (path) {
+        error = posix_spawn(&pid, path, &fa, &attr, (char *const *) argv, environ);
+        if (error == ENOENT && path != argv[0]) {
+            // stale entry, the binary moved or went away
+            path_cache_del(argv[0]);
+            path = resolve_cmd(argv[0]);
+            if (path) {
+                error = posix_spawn(&pid, path, &fa, &attr, (char *const *) argv, environ);
+            }
+        }
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (error != 0) {
+        errno = error; 
+        return -1; 
+    }
+    return pid; 
+}
+
+// `a | b | c` with no empty stage, complaining otherwise
+bool pipeline_ok(const char **toks) {
+    bool empty = true; 
+    for (int i = 0; ; i++) {
+        if (toks[i] == NULL || toks[i] == PIPE_SEP) {
+            if (empty) {
+                out_puts(STDERR_FILENO, "ERROR: empty command in pipeline\n");
+                last_status = 2; 
+                return false; 
+            }
+            if (toks[i] == NULL) {
+                return true; 
+            }
+            empty = true; 
+        } else {
+            empty = false; 
+        }
+    }
+}
+
+// "a | b | c" from the first word of every stage, in the line arena
+char *pipeline_name(const char **toks) {
+    size_t name_len = strlen(toks[0]);
+    for (int i = 0; toks[i]; i++) {
+        if (toks[i] == PIPE_SEP) {
+            name_len += strlen(toks[i + 1]) + 3; 
+        }
+    }
+    char *name = arena_alloc(&line_arena, name_len + 1);
+    strcpy(name, toks[0]);
+    for (int i = 0; toks[i]; i++) {
+        if (toks[i] == PIPE_SEP) {
+            strcat(name, " | ");
+            strcat(name, toks[i + 1]);
+        }
+    }
+    return name; 
+}
+
+// "0-3,8,10-11" into set, false if it isn't such a list
+bool parse_cpus(const char *str, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (true) {
+        char *endptr; 
+        long lo = strtol(str, &endptr, 10);
+        long hi = lo; 
+        if (endptr == str || lo < 0) {
+            return false; 
+        }
+        if (*endptr == '-') {
+            str = endptr + 1; 
+            hi = strtol(str, &endptr, 10);
+            if (endptr == str || hi < lo) {
+                return false; 
+            }
+        }
+        if (hi >= CPU_SETSIZE) {
+            return false; 
+        }
+        for (long c = lo; c <= hi; c++) {
+            CPU_SET(c, set);
+        }
+        if (*endptr == '\0' || *endptr == '\n') {
+            return true; 
+        }
+        if (*endptr != ',') {
+            return false; 
+        }
+        str = endptr + 1; 
+    }
+}
+
+// set back into the "0-3,8" form
+void format_cpus(const cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0; 
+    buf[0] = '\0'; 
+    for (int c = 0; c < CPU_SETSIZE && len < size; c++) {
+        if (!CPU_ISSET(c, set) || (c > 0 && CPU_ISSET(c - 1, set))) {
+            continue; 
+        }
+        int end = c; 
+        while (end + 1 < CPU_SETSIZE && CPU_ISSET(end + 1, set)) {
+            end++; 
+        }
+        len += snprintf(buf + len, size - len, end > c ? "%s%d-%d" : "%s%d", len ? "," : "", c, end);
+    }
+}
+
+// online CPUs and NUMA nodes from /sys/devices/system, read once; one node holding every CPU
+// when the kernel has no NUMA
+void topo_init() {
+    if (topo_state) {
+        return; 
+    }
+    topo_state = 1; 
+    char buf[4096];
+    int fd = open("/sys/devices/system/cpu/online", O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd == -1 ? -1 : read(fd, buf, sizeof(buf) - 1);
+    if (fd != -1) {
+        close(fd);
+    }
+    buf[n > 0 ? n : 0] = '\0'; 
+    if (n <= 0 || !parse_cpus(buf, &cpus_online)) {
+        sched_getaffinity(0, sizeof(cpu_set_t), &cpus_online);
+    }
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &cpus_online)) {
+            ncpus = c + 1; 
+        }
+    }
+    cpu_node = calloc(ncpus, sizeof(int));
+    cpu_load = calloc(ncpus, sizeof(int));
+    cpu_order = malloc(ncpus * sizeof(int));
+    assert(cpu_node && cpu_load && cpu_order);
+    for (int node = 0; node < 64; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            break; 
+        }
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        buf[n > 0 ? n : 0] = '\0'; 
+        node_cpus = realloc(node_cpus, (nnodes + 1) * sizeof(cpu_set_t));
+        assert(node_cpus);
+        if (!parse_cpus(buf, &node_cpus[nnodes])) {
+            CPU_ZERO(&node_cpus[nnodes]); // a node with memory only
+        }
+        CPU_AND(&node_cpus[nnodes], &node_cpus[nnodes], &cpus_online);
+        for (int c = 0; c < ncpus; c++) {
+            if (CPU_ISSET(c, &node_cpus[nnodes])) {
+                cpu_node[c] = nnodes; 
+            }
+        }
+        nnodes++; 
+    }
+    if (nnodes == 0) {
+        node_cpus = malloc(sizeof(cpu_set_t));
+        assert(node_cpus);
+        node_cpus[0] = cpus_online; 
+        nnodes = 1; 
+    }
+    // node 0's first CPU, node 1's first CPU, ..., node 0's second CPU, ...: ties spread over nodes
+    int k = 0; 
+    for (int round = 0; k < CPU_COUNT(&cpus_online); round++) {
+        for (int node = 0; node < nnodes; node++) {
+            int seen = 0; 
+            for (int c = 0; c < ncpus; c++) {
+                if (CPU_ISSET(c, &node_cpus[node]) && seen++ == round) {
+                    cpu_order[k++] = c; 
+                    break; 
+                }
+            }
+        }
+    }
+}
+
+// the least loaded online CPU, or for a pipeline (stages > 1) the least loaded node's CPUs, so its
+// stages still run side by side; memory is then preferred from that node
+void place_auto(int stages, cpu_set_t *set, int *node) {
+    CPU_ZERO(set);
+    if (stages > 1 && nnodes > 1) {
+        int best = 0; 
+        double best_load = 1e18; 
+        for (int i = 0; i < nnodes; i++) {
+            int count = CPU_COUNT(&node_cpus[i]);
+            long load = 0; 
+            for (int c = 0; c < ncpus; c++) {
+                load += CPU_ISSET(c, &node_cpus[i]) ? cpu_load[c] : 0; 
+            }
+            if (count > 0 && (double)load / count < best_load) {
+                best = i; 
+                best_load = (double)load / count; 
+            }
+        }
+        *set = node_cpus[best]; 
+        *node = best; 
+        return; 
+    }
+    int best = cpu_order[0]; 
+    for (int i = 1; i < CPU_COUNT(&cpus_online); i++) {
+        if (cpu_load[cpu_order[i]] < cpu_load[best]) {
+            best = cpu_order[i]; 
+        }
+    }
+    CPU_SET(best, set);
+    *node = cpu_node[best]; 
+}
+
+// fill in where job's stages go, from place's options or place on; false if they run as they are
+bool place_job(job_t *job, const job_opts_t *opts, int stages, child_setup_t *setup) {
+    bool explicit = opts && (opts->set_cpus || opts->set_nice || opts->set_node); 
+    if (!explicit && !place_mode) {
+        return false; 
+    }
+    topo_init();
+    job->cpus = malloc(sizeof(cpu_set_t));
+    assert(job->cpus);
+    if (opts && opts->set_cpus) {
+        *job->cpus = opts->place_cpus; 
+    } else if (!explicit) {
+        place_auto(stages, job->cpus, &job->mem_node);
+        job->auto_placed = true; 
+        for (int c = 0; c < ncpus; c++) {
+            cpu_load[c] += CPU_ISSET(c, job->cpus) ? 1 : 0; 
+        }
+    } else {
+        free(job->cpus);
+        job->cpus = NULL; 
+    }
+    if (opts && opts->set_node) {
+        job->mem_node = opts->node; 
+    }
+    setup->cpus = job->cpus; 
+    if (job->mem_node >= 0) {
+        // an explicit node is a must, the automatic one a preference
+        setup->mpol = opts && opts->set_node ? MPOL_BIND : MPOL_PREFERRED; 
+        setup->mems = 1UL << job->mem_node; 
+    }
+    if (opts && opts->set_nice) {
+        setup->set_nice = true; 
+        setup->nice = opts->nice; 
+        job->niced = true; 
+        job->nice = opts->nice; 
+    }
+    return true; 
+}
+
+// job ended or never started: its CPUs are free for the next auto-placed one
+void place_release(job_t *job) {
+    if (job->auto_placed) {
+        job->auto_placed = false; 
+        for (int c = 0; c < ncpus; c++) {
+            cpu_load[c] -= CPU_ISSET(c, job->cpus) ? 1 : 0; 
+        }
+    }
+}
+
+// start every stage of job, which has no pids yet, in one new process group;
+// with capture, stdout of the last stage and stderr of all of them go to a joblog;
+// in cgroup mode or with limits in opts (which may be NULL) the job gets a cgroup of its own;
+// stages are split in place at PIPE_SEP, nothing started leaves job->npids at 0
+void spawn_stages(job_t *job, const char **toks, bool capture, const job_opts_t *opts, struct sigaction *act, struct sigaction *act_fg) {
+    int ntoks = 0; 
+    int nstages = 1; 
+    while (toks[ntoks]) {
+        if (toks[ntoks++] == PIPE_SEP) {
+            nstages++; 
+        }
+    }
+    const char ***stages = arena_alloc(&line_arena, nstages * sizeof(char **));
+    stages[0] = toks; 
+    for (int i = 0, k = 1; i < ntoks; i++) {
+        if (toks[i] == PIPE_SEP) {
+            toks[i] = NULL; 
+            stages[k++] = &toks[i + 1];
+        }
+    }
+    // optional: bigger pipe buffers for high-throughput stages
+    const char *pipe_size_env = getenv("CRASH_PIPE_SIZE");
+    int pipe_size = pipe_size_env ? atoi(pipe_size_env) : 0; 
+
+    out_flush(); // earlier notices go out ahead of anything the job prints
+    sigset_t old; 
+    sigprocmask(SIG_BLOCK, &(act->sa_mask), &old);  
+    int log_fd = -1; 
+    if (capture) {
+        job->log = joblog_new(job->jid, &log_fd);
+    }
+    bool limited = opts && (opts->cpus > 0 || opts->mem_max > 0 || opts->pids_max > 0); 
+    if ((cgroup_mode || limited) && cgroup_init()) {
+        cgroup_attach(job, opts);
+    }
+    child_setup_t setup = { job->cg_fd, NULL, 0, 0, false, 0 };
+    bool has_setup = place_job(job, opts, nstages, &setup) || job->cg_fd != -1; 
+    pid_t pgid = 0; 
+    int in_fd = -1; 
+    for (int k = 0; k < nstages; k++) {
+        int fds[2] = {-1, -1};
+        if (k < nstages - 1) {
+            if (pipe2(fds, O_CLOEXEC) == -1) {
+                out_printf(STDERR_FILENO, "ERROR: %s\n", strerror(errno));
+                break; 
+            }
+            if (pipe_size > 0) {
+                fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+            }
+        }
+        int out_fd = k < nstages - 1 ? fds[1] : log_fd; 
+        uint64_t t0 = stats_on ? now_ns() : 0; 
+        pid_t p1 = spawn_cmd(stages[k], pgid, in_fd, out_fd, log_fd, has_setup ? &setup : NULL, act_fg);
+        if (stats_on) {
+            hist_record(&hist_spawn, now_ns() - t0);
+            stat_spawned += p1 > 0; 
+            stat_spawn_errors += p1 <= 0; 
+        }
+        if (p1 > 0) {
+            if (pgid == 0) {
+                pgid = p1; 
+            }
+            // also done here so the group exists before we signal it
+            setpgid(p1, pgid);
+            add_pid(job, p1);
+        } else if (errno == EAGAIN || errno == ENOMEM) {
+            out_printf(STDERR_FILENO, "ERROR: %s\n", strerror(errno));
+        } else {
+            out_printf(STDERR_FILENO, "ERROR: cannot run %s\n", stages[k][0]);
+        }
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        in_fd = fds[0]; 
+    }
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    if (log_fd != -1) {
+        close(log_fd);
+    }
+    if (job->npids == 0 && job->log) {
+        joblog_free(job->log);
+        job->log = NULL; 
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// make a job for toks and start every stage (see spawn_stages), NULL (with last_status set) if nothing started
+job_t *start_job(const char **toks, bool capture, const job_opts_t *opts, struct sigaction *act, struct sigaction *act_fg) {
+    // parallel refills land here from the event loop, possibly many times per line
+    arena_mark_t mark = arena_mark(&line_arena);
+    if (!pipeline_ok(toks)) {
+        arena_release(&line_arena, mark);
+        return NULL; 
+    }
+    add_job(jobs, pipeline_name(toks), getpid());  // add job without pid 
+    job_t *job = get_last_job(jobs);
+    spawn_stages(job, toks, capture, opts, act, act_fg);
+    if (job->npids == 0) {
+        // nothing started, hand the jid back
+        remove_job(jobs, job);
+        jobs->curr_jid--; 
+        last_status = 127; 
+        job = NULL; 
+    }
+    arena_release(&line_arena, mark);
+    return job; 
+}
+
+// parallel -j N: a queue of items fed to a command template, at most N tasks alive at a time
+typedef struct parallel_run {
+    const char **tmpl; // tokens, "{}" inside one marks where the item goes
+    int ntmpl; 
+    bool has_slot; // otherwise the item is appended as the last argument
+    char **items; 
+    size_t nitems; 
+    size_t next; // first item not started yet
+    int limit; 
+    int running; 
+    int failed; 
+    bool bg; // nobody waits on it, so it frees itself when done
+    struct sigaction *act; 
+    struct sigaction *act_fg; 
+} parallel_run_t; 
+
+void free_run(parallel_run_t *run) {
+    for (int i = 0; i < run->ntmpl; i++) {
+        if (run->tmpl[i] != PIPE_SEP) {
+            free((char *)run->tmpl[i]);
+        }
+    }
+    for (size_t i = 0; i < run->nitems; i++) {
+        free(run->items[i]);
+    }
+    free(run->tmpl);
+    free(run->items);
+    free(run);
+}
+
+// copy of tok with every {} replaced by item
+char *fill_slot(const char *tok, const char *item) {
+    size_t item_len = strlen(item);
+    size_t len = strlen(tok) + 1; 
+    for (const char *p = strstr(tok, "{}"); p; p = strstr(p + 2, "{}")) {
+        len += item_len; 
+    }
+    char *out = malloc(len);
+    assert(out);
+    char *o = out; 
+    while (*tok) {
+        if (tok[0] == '{' && tok[1] == '}') {
+            memcpy(o, item, item_len);
+            o += item_len; 
+            tok += 2; 
+        } else {
+            *o++ = *tok++; 
+        }
+    }
+    *o = '\0'; 
+    return out; 
+}
+
+// start queued items until the run is at its limit
+void parallel_fill(parallel_run_t *run) {
+    while (run->running < run->limit && run->next < run->nitems) {
+        const char *item = run->items[run->next++];
+        const char *argv[run->ntmpl + 2];
+        char *filled[run->ntmpl + 1];
+        int nfilled = 0; 
+        int t = 0; 
+        for (int i = 0; i < run->ntmpl; i++) {
+            if (run->tmpl[i] != PIPE_SEP && strstr(run->tmpl[i], "{}")) {
+                filled[nfilled] = fill_slot(run->tmpl[i], item);
+                argv[t++] = filled[nfilled++];
+            } else {
+                argv[t++] = run->tmpl[i];
+            }
+        }
+        if (!run->has_slot) {
+            argv[t++] = item; 
+        }
+        argv[t] = NULL; 
+        job_t *job = start_job(argv, capture_mode, NULL, run->act, run->act_fg);
+        for (int i = 0; i < nfilled; i++) {
+            free(filled[i]);
+        }
+        if (job == NULL) {
+            run->failed++; 
+            continue; 
+        }
+        job->run = run; 
+        run->running++; 
+        out_printf(STDOUT_FILENO, "[%d] (%d)  running  %s\n", job->jid, job->pid, job->name);
+    }
+}
+
+bool parallel_done(parallel_run_t *run) {
+    return run->running == 0 && run->next == run->nitems; 
+}
+
+// called from handle_exit, refills the slot the task held
+void parallel_task_done(job_t *job) {
+    parallel_run_t *run = job->run; 
+    job->run = NULL; 
+    run->running--; 
+    if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0) {
+        run->failed++; 
+    }
+    parallel_fill(run);
+    if (run->bg && parallel_done(run)) {
+        out_printf(STDOUT_FILENO, "parallel: %zu tasks done, %d failed\n", run->nitems, run->failed);
+        free_run(run);
+    }
+}
+
+// parallel [-j N] [-a file] cmd args... [::: item...]
+void parallel_cmd(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *file = NULL; 
+    int i = 1; 
+    while (toks[i] && toks[i] != PIPE_SEP && toks[i][0] == '-') {
+        char *endptr; 
+        if (strncmp(toks[i], "-j", 2) == 0 && (toks[i][2] || toks[i + 1])) {
+            // both -j 4 and -j4
+            const char *arg = toks[i][2] ? toks[i] + 2 : toks[++i];
+            limit = strtol(arg, &endptr, 10);
+            if (*endptr != '\0' || limit <= 0) {
+                out_printf(STDERR_FILENO, "ERROR: bad argument for parallel -j: %s\n", arg);
+                return; 
+            }
+            i++; 
+            continue; 
+        } else if (strcmp(toks[i], "-a") == 0 && toks[i + 1]) {
+            file = toks[i + 1];
+        } else {
+            out_puts(STDERR_FILENO, "ERROR: usage: parallel [-j N] [-a file] cmd args... [::: items...]\n");
+            return; 
+        }
+        i += 2; 
+    }
+    int tmpl_start = i; 
+    while (toks[i] && strcmp(toks[i], ":::") != 0) {
+        i++; 
+    }
+    if (i == tmpl_start || (toks[i] == NULL) == (file == NULL)) {
+        out_puts(STDERR_FILENO, "ERROR: usage: parallel [-j N] [-a file] cmd args... [::: items...]\n");
+        return; 
+    }
+
+    parallel_run_t *run = calloc(1, sizeof(parallel_run_t));
+    assert(run);
+    run->limit = limit; 
+    run->act = act; 
+    run->act_fg = act_fg; 
+    run->ntmpl = i - tmpl_start; 
+    run->tmpl = malloc(run->ntmpl * sizeof(char *));
+    assert(run->tmpl);
+    for (int k = 0; k < run->ntmpl; k++) {
+        const char *tok = toks[tmpl_start + k];
+        run->tmpl[k] = tok == PIPE_SEP ? PIPE_SEP : strdup(tok);
+        if (tok != PIPE_SEP && strstr(tok, "{}")) {
+            run->has_slot = true; 
+        }
+    }
+    size_t cap = 16; 
+    run->items = malloc(cap * sizeof(char *));
+    assert(run->items);
+    if (file) {
+        FILE *f = fopen(file, "r");
+        if (!f) {
+            out_printf(STDERR_FILENO, "ERROR: cannot open %s\n", file);
+            free_run(run);
+            return; 
+        }
+        char *line = NULL; 
+        size_t len = 0; 
+        ssize_t n; 
+        while ((n = getline(&line, &len, f)) != -1) {
+            if (n > 0 && line[n - 1] == '\n') {
+                line[--n] = '\0'; 
+            }
+            if (n == 0) {
+                continue; 
+            }
+            if (run->nitems == cap) {
+                cap *= 2; 
+                run->items = realloc(run->items, cap * sizeof(char *));
+                assert(run->items);
+            }
+            run->items[run->nitems++] = strdup(line);
+        }
+        free(line);
+        fclose(f);
+    } else {
+        for (i++; toks[i]; i++) {
+            if (run->nitems == cap) {
+                cap *= 2; 
+                run->items = realloc(run->items, cap * sizeof(char *));
+                assert(run->items);
+            }
+            run->items[run->nitems++] = strdup(toks[i]);
+        }
+    }
+
+    sigset_t old; 
+    sigprocmask(SIG_BLOCK, &wait_mask, &old);
+    parallel_fill(run);
+    if (bg) {
+        run->bg = true; 
+        if (parallel_done(run)) {
+            free_run(run);
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return; 
+    }
+    fg = true; 
+    while (!parallel_done(run) && flag_c == false && flag_q == false && flag_z == false) {
+        wait_events(-1);
+    }
+    if (flag_z) {
+        // like ^Z on a job, but the tasks keep running: hand the run to the event loop
+        out_printf(STDOUT_FILENO, "parallel: %zu tasks left, continuing in background\n", run->nitems - run->next + run->running);
+        run->bg = true; 
+        flag_z = false; 
+    } else {
+        if (flag_c || flag_q) {
+            // drop the queue and take the running tasks down with the same signal
+            int sig = flag_c ? SIGINT : SIGQUIT; 
+            flag_c = false; 
+            flag_q = false; 
+            run->next = run->nitems; 
+            for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+                if (curr->run == run) {
+                    signal_job(curr, sig);
+                }
+            }
+            while (!parallel_done(run)) {
+                wait_events(-1);
+            }
+            last_status = 128 + sig; 
+        } else {
+            last_status = run->failed ? 1 : 0; 
+        }
+        free_run(run);
+    }
+    fg = false; 
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void run_job(const char **toks, bool bg, const job_opts_t *opts, struct sigaction *act, struct sigaction *act_fg);
+
+// signal every target's group in one pass, then stay in the event loop until each is reaped;
+// grace_ms >= 0 sends SIGTERM first and SIGKILL to whatever is left once it runs out
+void nuke_jobs(job_t **targets, int n, int grace_ms) {
+    int sig = grace_ms >= 0 ? SIGTERM : SIGKILL; 
+    for (int i = 0; i < n; i++) {
+        job_t *curr = targets[i];
+        if (!curr->waited) {
+            curr->waited = true; 
+            wait_remaining++; 
+        }
+        signal_job(curr, sig);
+        if (sig == SIGTERM && curr->suspended) {
+            signal_job(curr, SIGCONT); // stopped processes only act on SIGTERM once continued
+        }
+        curr->notified = true; 
+        out_printf(STDOUT_FILENO, "[%d] (%d)  killed  %s\n", curr->jid, curr->pid, curr->name);
+    }
+    struct timespec start; 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fg = true; 
+    while (wait_remaining > 0 && !flag_c && !flag_q) {
+        int timeout = -1; 
+        if (sig == SIGTERM) {
+            struct timespec now; 
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout = grace_ms - (int)(elapsed(&start, &now) * 1000);
+            if (timeout <= 0) {
+                // every target, since one whose stages are gone may still have members in its group
+                sig = SIGKILL; 
+                timeout = -1; 
+                for (int i = 0; i < n; i++) {
+                    signal_job(targets[i], SIGKILL);
+                }
+            }
+        }
+        wait_events(timeout);
+        flag_z = false; 
+    }
+    fg = false; 
+    flag_c = false; 
+    flag_q = false; 
+    for (int i = 0; i < n; i++) {
+        targets[i]->waited = false; 
+    }
+    wait_remaining = 0; 
+}
+
+// %jid or pid to a job, printing the usual errors when there is none
+job_t *lookup_job_arg(const char *cmd, const char *arg) {
+    const char *str = arg[0] == '%' ? arg + 1 : arg; 
+    char *endptr; 
+    int saved_errno = errno; 
+    errno = 0; 
+    long num = strtol(str, &endptr, 10);
+    bool bad = errno == ERANGE || endptr == str || *endptr != '\0'; 
+    errno = saved_errno; 
+    if (bad) {
+        out_printf(STDERR_FILENO, "ERROR: bad argument for %s: %s\n", cmd, arg);
+        return NULL; 
+    }
+    job_t *job = arg[0] == '%' ? get_job_jid(num) : get_job_pid(num);
+    if (!job) {
+        out_printf(STDERR_FILENO, arg[0] == '%' ? "ERROR: no job %s\n" : "ERROR: no PID %s\n", str);
+    }
+    return job; 
+}
+
+void builtin_quit(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] != NULL) {
+        out_puts(STDERR_FILENO, "ERROR: quit takes no arguments\n");
+    } else {
+        exit(last_status);
+    }
+}
+
+void builtin_jobs(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    bool long_fmt = toks[1] != NULL && strcmp(toks[1], "-l") == 0; 
+    if (toks[1] != NULL && (!long_fmt || toks[2] != NULL)) {
+        out_puts(STDERR_FILENO, "ERROR: jobs takes no arguments except -l\n");
+    } else {
+        // remove dead processes from job list 
+        clean_jobs(); 
+        job_t *curr = jobs->jobs_list; 
+        struct timespec now; 
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        while (curr != NULL) {
+            if (curr->node) {
+                out_printf(STDOUT_FILENO, "[%d] (-)  waiting  %s\n", curr->jid, curr->name);
+            } else if (long_fmt) {
+                // live jobs have no rusage yet, so sample /proc for every stage
+                double cpu = 0; 
+                long rss_kb = 0; 
+                for (int i = 0; i < curr->npids; i++) {
+                    proc_usage(curr->pids[i], &cpu, &rss_kb);
+                }
+                out_printf(STDOUT_FILENO, "[%d] (%d)  %s  wall %.3fs  cpu %.3fs  rss %ldKB  ", curr->jid, curr->pid,
+                         curr->suspended ? "suspended" : "running", elapsed(&curr->start, &now), cpu, rss_kb);
+                if (curr->cg_fd != -1) {
+                    print_cgroup_usage(curr);
+                }
+                if (curr->cpus) {
+                    char list[256];
+                    format_cpus(curr->cpus, list, sizeof(list));
+                    out_printf(STDOUT_FILENO, "cpus %s  ", list);
+                }
+                if (curr->mem_node >= 0) {
+                    out_printf(STDOUT_FILENO, "node %d  ", curr->mem_node);
+                }
+                if (curr->niced) {
+                    out_printf(STDOUT_FILENO, "nice %d  ", curr->nice);
+                }
+                if (curr->heap_idx >= 0) {
+                    out_printf(STDOUT_FILENO, "%s in %.3fs  ", curr->deadline_sig == SIGKILL ? "kill" : "timeout",
+                             elapsed(&now, &curr->deadline));
+                }
+                out_printf(STDOUT_FILENO, "%s\n", curr->name);
+            } else if (curr->suspended) {
+                out_printf(STDOUT_FILENO, "[%d] (%d)  suspended  %s\n", curr->jid, curr->pid, curr->name);
+            } else {
+                out_printf(STDOUT_FILENO, "[%d] (%d)  running  %s\n", curr->jid, curr->pid, curr->name);
+            }
+            curr = curr->next; 
+        }
+    }
+}
+
+// nuke [-t SECS] [%jid|pid ...]: kill the listed jobs, or all of them, and reap them before returning;
+// -t gives them SECS to exit after SIGTERM before SIGKILL
+void builtin_nuke(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    int i = 1; 
+    int grace_ms = -1; 
+    if (toks[1] && strcmp(toks[1], "-t") == 0) {
+        char *endptr = NULL; 
+        double secs = toks[2] ? strtod(toks[2], &endptr) : -1; 
+        if (!toks[2] || *endptr != '\0' || secs < 0 || secs > INT_MAX / 1000) {
+            out_puts(STDERR_FILENO, "ERROR: nuke -t needs a number of seconds\n");
+            last_status = 2; 
+            return; 
+        }
+        grace_ms = secs * 1000; 
+        i = 3; 
+    }
+    sigset_t old; 
+    sigprocmask(SIG_BLOCK, &wait_mask, &old);
+    clean_jobs();
+    job_t **targets = arena_alloc(&line_arena, (jobs->by_jid.count + 1) * sizeof(job_t *));
+    int n = 0; 
+    if (toks[i] == NULL) {
+        for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+            targets[n++] = curr; 
+        }
+    }
+    for (; toks[i]; i++) {
+        job_t *curr = lookup_job_arg("nuke", toks[i]);
+        if (curr && !curr->waited) {
+            curr->waited = true; // also drops duplicates
+            targets[n++] = curr; 
+        }
+    }
+    for (int k = 0; k < n; k++) {
+        targets[k]->waited = false; 
+    }
+    nuke_jobs(targets, n, grace_ms);
+    clean_jobs();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void builtin_fg(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    sigprocmask(SIG_BLOCK, &(act->sa_mask), NULL); 
+    if (toks[1] == NULL || toks[2] != NULL) {
+        out_puts(STDERR_FILENO, "ERROR: fg needs exactly one argument\n");
+    } else {
+        job_t *curr; 
+        char* endptr; 
+        int saved_errno = errno;
+
+        const char *str = toks[1];
+        if (str[0] == '%') {
+            const char *temp = str; 
+            temp++; 
+            str = temp; 
+        }
+
+        long num = strtol(str, &endptr, 10);
+        if (errno == ERANGE || endptr == str || *endptr != '\0') {
+            out_printf(STDERR_FILENO, "ERROR: bad argument for fg: %s\n", toks[1]);
+        } else {
+            // set fg true
+            fg = true; 
+            if (toks[1][0] == '%') {
+                const char *temp = toks[1];
+                temp++; 
+                clean_jobs();
+                curr = get_job_jid(num);
+                if (!curr) {
+                    out_printf(STDERR_FILENO, "ERROR: no job %s\n", temp);
+                } else if (curr->node) {
+                    out_printf(STDERR_FILENO, "ERROR: job %s has not started yet\n", temp);
+                } else {
+                    if (curr->suspended) {
+                        signal_job(curr, SIGCONT);
+                        out_printf(STDOUT_FILENO, "[%d] (%d)  continued  %s\n", curr->jid, curr->pid, curr->name);
+                        set_job_suspended(curr, false);
+                    }
+                    int status;
+                    wait_fg(curr, &status);
+
+                    print_status(curr->pid, curr->name);
+                }
+            } else {
+                clean_jobs();
+                curr = get_job_pid(num); 
+                if (!curr) {
+                    out_printf(STDERR_FILENO, "ERROR: no PID %s\n", toks[1]);
+                } else {
+                    if (curr->suspended) {
+                        signal_job(curr, SIGCONT);
+                        out_printf(STDOUT_FILENO, "[%d] (%d)  continued  %s\n", curr->jid, curr->pid, curr->name);
+                        set_job_suspended(curr, false);
+                    }
+                    int status;
+                    wait_fg(curr, &status);
+
+                    print_status(curr->pid, curr->name);
+                }
+            }
+            // set fg false again
+            fg = false; 
+        }
+        errno = saved_errno; 
+    }
+    // every path, errors included, leaves SIGCHLD as it found it
+    sigprocmask(SIG_UNBLOCK, &(act->sa_mask), NULL);
+}
+
+void builtin_bg(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] == NULL) {
+        out_puts(STDERR_FILENO, "ERROR: bg needs some arguments\n");
+    } else {
+        int i = 1;
+        while(toks[i]) {
+            job_t *curr; 
+            char* endptr; 
+            int saved_errno = errno;
+
+            const char *str = toks[i];
+            if (str[0] == '%') {
+                const char *temp = str; 
+                temp++; 
+                str = temp; 
+            }
+
+            long num = strtol(str, &endptr, 10);
+            if (errno == ERANGE || endptr == str || *endptr != '\0') {
+                out_printf(STDERR_FILENO, "ERROR: bad argument for bg: %s\n", toks[i]);
+            } else {
+                if (toks[i][0] == '%') {
+                    const char *temp = toks[i];
+                    temp++; 
+                    clean_jobs();
+                    curr = get_job_jid(num);
+                    if (!curr || curr->suspended == false) {
+                        out_printf(STDERR_FILENO, "ERROR: no job %s\n", temp);
+                    } else {
+                        signal_job(curr, SIGCONT);
+                        out_printf(STDOUT_FILENO, "[%d] (%d)  continued  %s\n", curr->jid, curr->pid, curr->name);
+                        set_job_suspended(curr, false);
+                    }
+                } else {
+                    clean_jobs();
+                    curr = get_job_pid(num); 
+                    if (!curr || curr->suspended == false) {
+                        out_printf(STDERR_FILENO, "ERROR: no PID %s\n", toks[i]);
+                    } else {
+                        signal_job(curr, SIGCONT);
+                        out_printf(STDOUT_FILENO, "[%d] (%d)  continued  %s\n", curr->jid, curr->pid, curr->name);
+                        set_job_suspended(curr, false);
+                    }
+                }
+            }
+            i++;
+            errno = saved_errno; 
+        }
+    }
+}
+
+void builtin_hash(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    path_cache_check();
+    if (toks[1] == NULL) {
+        for (size_t i = 0; i < path_cache.cap; i++) {
+            path_slot_t *slot = &path_cache.slots[i];
+            if (slot->name) {
+                out_printf(STDOUT_FILENO, "%s  %s  %u\n", slot->name, slot->path, slot->hits);
+            }
+        }
+    } else if (strcmp(toks[1], "-r") == 0) {
+        if (toks[2] != NULL) {
+            out_puts(STDERR_FILENO, "ERROR: hash -r takes no arguments\n");
+        } else {
+            path_cache_clear();
+        }
+    } else {
+        for (int i = 1; toks[i]; i++) {
+            // seeding resolves now, so a later launch is a pure cache hit
+            path_cache_del(toks[i]);
+            if (strchr(toks[i], '/') || !resolve_cmd(toks[i])) {
+                out_printf(STDERR_FILENO, "ERROR: hash: no such command %s\n", toks[i]);
+            } else {
+                path_cache_slot(toks[i])->hits = 0; 
+            }
+        }
+    }
+}
+
+void builtin_parallel(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (jobs_full()) {
+        out_puts(STDERR_FILENO, "ERROR: too many jobs\n");
+        return; 
+    }
+    parallel_cmd(toks, bg, act, act_fg);
+}
+
+// 10, 2.5s, 3m, 1h or 1d, like timeout(1)
+bool parse_duration(const char *str, double *secs) {
+    char *endptr; 
+    errno = 0; 
+    double d = strtod(str, &endptr);
+    if (errno != 0 || endptr == str || d < 0 || d > 1e9) {
+        return false; 
+    }
+    switch (*endptr) {
+    case '\0': 
+    case 's': break; 
+    case 'm': d *= 60; break; 
+    case 'h': d *= 3600; break; 
+    case 'd': d *= 86400; break; 
+    default: return false; 
+    }
+    if (*endptr != '\0' && endptr[1] != '\0') {
+        return false; 
+    }
+    *secs = d; 
+    return true; 
+}
+
+// 4096, 512K, 64M or 2G
+bool parse_size(const char *str, long long *bytes) {
+    char *endptr; 
+    errno = 0; 
+    long long n = strtoll(str, &endptr, 10);
+    if (errno != 0 || endptr == str || n <= 0) {
+        return false; 
+    }
+    int shift = 0; 
+    switch (*endptr) {
+    case '\0': break; 
+    case 'k': case 'K': shift = 10; break; 
+    case 'm': case 'M': shift = 20; break; 
+    case 'g': case 'G': shift = 30; break; 
+    default: return false; 
+    }
+    if ((*endptr != '\0' && endptr[1] != '\0') || n > (LLONG_MAX >> shift)) {
+        return false; 
+    }
+    *bytes = n << shift; 
+    return true; 
+}
+
+// limit's flags into opts, returns how many tokens they took or -1 after complaining
+int parse_limits(const char **toks, job_opts_t *opts) {
+    int i = 1; 
+    while (toks[i] && toks[i][0] == '-' && toks[i + 1]) {
+        char *endptr; 
+        bool ok; 
+        if (strcmp(toks[i], "-c") == 0) {
+            opts->cpus = strtod(toks[i + 1], &endptr);
+            ok = *endptr == '\0' && opts->cpus > 0 && opts->cpus < 1e6; 
+        } else if (strcmp(toks[i], "-m") == 0) {
+            ok = parse_size(toks[i + 1], &opts->mem_max);
+        } else if (strcmp(toks[i], "-p") == 0) {
+            opts->pids_max = strtol(toks[i + 1], &endptr, 10);
+            ok = *endptr == '\0' && opts->pids_max > 0; 
+        } else {
+            break; 
+        }
+        if (!ok) {
+            out_printf(STDERR_FILENO, "ERROR: bad value for limit %s: %s\n", toks[i], toks[i + 1]);
+            return -1; 
+        }
+        i += 2; 
+    }
+    if (i == 1) {
+        out_puts(STDERR_FILENO, "ERROR: usage: limit [-c CPUS] [-m BYTES] [-p PIDS] cmd\n");
+        return -1; 
+    }
+    return i; 
+}
+
+// place's flags into opts, returns how many tokens they took or -1 after complaining
+int parse_place(const char **toks, job_opts_t *opts) {
+    int i = 1; 
+    while (toks[i] && strncmp(toks[i], "--", 2) == 0 && toks[i + 1]) {
+        char *endptr; 
+        bool ok; 
+        if (strcmp(toks[i], "--cpus") == 0) {
+            topo_init();
+            cpu_set_t online; 
+            ok = parse_cpus(toks[i + 1], &opts->place_cpus);
+            CPU_AND(&online, &opts->place_cpus, &cpus_online);
+            ok = ok && CPU_COUNT(&online) > 0; 
+            opts->set_cpus = true; 
+        } else if (strcmp(toks[i], "--nice") == 0) {
+            long nice = strtol(toks[i + 1], &endptr, 10);
+            ok = *endptr == '\0' && nice >= -20 && nice <= 19; 
+            opts->nice = nice; 
+            opts->set_nice = true; 
+        } else if (strcmp(toks[i], "--node") == 0) {
+            topo_init();
+            long node = strtol(toks[i + 1], &endptr, 10);
+            ok = *endptr == '\0' && node >= 0 && node < nnodes; 
+            opts->node = node; 
+            opts->set_node = true; 
+        } else {
+            break; 
+        }
+        if (!ok) {
+            out_printf(STDERR_FILENO, "ERROR: bad value for place %s: %s\n", toks[i], toks[i + 1]);
+            return -1; 
+        }
+        i += 2; 
+    }
+    if (i == 1) {
+        out_puts(STDERR_FILENO, "ERROR: usage: place [--cpus LIST] [--nice N] [--node N] cmd | place on|off\n");
+        return -1; 
+    }
+    return i; 
+}
+
+// time, timeout, limit and place are prefixes and can be stacked: `time timeout -k 5 60 make`;
+// fills in opts and returns how many tokens they took, or -1 after complaining
+int parse_prefixes(const char **toks, job_opts_t *opts) {
+    const char **start = toks; 
+    while (toks[0]) {
+        if (strcmp(toks[0], "time") == 0) {
+            opts->timed = true; 
+            toks++; 
+        } else if (strcmp(toks[0], "timeout") == 0) {
+            int i = 1; 
+            if (toks[i] && strcmp(toks[i], "-k") == 0) {
+                if (!toks[i + 1] || !parse_duration(toks[i + 1], &opts->kill_after)) {
+                    out_puts(STDERR_FILENO, "ERROR: timeout -k needs a duration\n");
+                    last_status = 125; 
+                    return -1; 
+                }
+                i += 2; 
+            }
+            if (!toks[i] || !parse_duration(toks[i], &opts->timeout)) {
+                out_puts(STDERR_FILENO, "ERROR: timeout needs a duration and a command\n");
+                last_status = 125; 
+                return -1; 
+            }
+            toks += i + 1; 
+        } else if (strcmp(toks[0], "limit") == 0 || strcmp(toks[0], "place") == 0) {
+            int i = toks[0][0] == 'l' ? parse_limits(toks, opts) : parse_place(toks, opts);
+            if (i < 0) {
+                last_status = 2; 
+                return -1; 
+            }
+            toks += i; 
+        } else {
+            break; 
+        }
+    }
+    return toks - start; 
+}
+
+// time cmd: report the job's wall, user and sys time, peak RSS and exit code when it ends
+// timeout [-k KILL_AFTER] DURATION cmd: SIGTERM the job's group when DURATION runs out, status 124
+// limit [-c CPUS] [-m BYTES] [-p PIDS] cmd: run cmd in a cgroup of its own with cpu.max, memory.max
+// and pids.max set
+void builtin_prefix(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    job_opts_t opts = { .timed = false };
+    const char *prefix = toks[0];
+    int i = parse_prefixes(toks, &opts);
+    if (i < 0) {
+        return; 
+    }
+    toks += i; 
+    if (toks[0] == NULL) {
+        out_printf(STDERR_FILENO, "ERROR: %s needs a command\n", prefix);
+        last_status = 2; 
+        return; 
+    }
+    run_job(toks, bg, &opts, act, act_fg);
+}
+
+// place [--cpus LIST] [--nice N] [--node N] cmd: run cmd on those CPUs, at that niceness, with its memory
+// from that NUMA node; place on|off: spread every later job over the least loaded CPUs and nodes
+void builtin_place(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] == NULL) {
+        topo_init();
+        char list[256];
+        format_cpus(&cpus_online, list, sizeof(list));
+        out_printf(STDOUT_FILENO, "place %s  cpus %s  nodes %d\n", place_mode ? "on" : "off", list, nnodes);
+    } else if (toks[2] == NULL && (strcmp(toks[1], "on") == 0 || strcmp(toks[1], "off") == 0)) {
+        place_mode = strcmp(toks[1], "on") == 0; 
+    } else {
+        builtin_prefix(toks, bg, act, act_fg);
+    }
+}
+
+// cgroup [on|off]: whether every later job gets a cgroup, so nuke can kill all it started
+void builtin_cgroup(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] == NULL) {
+        if (cgroup_mode) {
+            out_printf(STDOUT_FILENO, "cgroup on  %s  controllers: %s\n", cg_path, cg_controllers[0] ? cg_controllers : "none");
+        } else {
+            out_puts(STDOUT_FILENO, "cgroup off\n");
+        }
+    } else if (toks[2] == NULL && strcmp(toks[1], "on") == 0) {
+        cgroup_mode = cgroup_init(); 
+        last_status = cgroup_mode ? 0 : 1; 
+    } else if (toks[2] == NULL && strcmp(toks[1], "off") == 0) {
+        cgroup_mode = false; 
+    } else {
+        out_puts(STDERR_FILENO, "ERROR: usage: cgroup [on|off]\n");
+        last_status = 2; 
+    }
+}
+
+// deadline %jid|pid DURATION: give a running job a timeout (replacing any it had), 0 removes it
+void builtin_deadline(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    double secs; 
+    if (!toks[1] || !toks[2] || toks[3] || !parse_duration(toks[2], &secs)) {
+        out_puts(STDERR_FILENO, "ERROR: usage: deadline %jid|pid DURATION\n");
+        last_status = 2; 
+        return; 
+    }
+    sigset_t old; 
+    sigprocmask(SIG_BLOCK, &wait_mask, &old);
+    job_t *job = lookup_job_arg("deadline", toks[1]);
+    if (!job) {
+        last_status = 1; 
+    } else if (job->exited) {
+        // already gone, nothing to time out
+    } else if (secs == 0) {
+        clear_deadline(job);
+    } else {
+        struct timespec now; 
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        job->deadline_sig = SIGTERM; 
+        set_deadline(job, ts_after(&now, secs));
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void builtin_cd(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] != NULL && toks[2] != NULL) {
+        out_puts(STDERR_FILENO, "ERROR: cd takes at most one argument\n");
+        last_status = 2; 
+        return; 
+    }
+    const char *dir = toks[1] ? toks[1] : getenv("HOME");
+    bool back = dir && strcmp(dir, "-") == 0; 
+    if (back) {
+        dir = getenv("OLDPWD");
+    }
+    if (dir == NULL) {
+        out_printf(STDERR_FILENO, "ERROR: cd: %s not set\n", back ? "OLDPWD" : "HOME");
+        last_status = 1; 
+        return; 
+    }
+    char *old = getcwd(NULL, 0);
+    if (chdir(dir) == -1) {
+        out_printf(STDERR_FILENO, "ERROR: cd: %s: %s\n", dir, strerror(errno));
+        last_status = 1; 
+        free(old);
+        return; 
+    }
+    if (old) {
+        setenv("OLDPWD", old, 1);
+        free(old);
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (cwd) {
+        setenv("PWD", cwd, 1);
+        if (back) {
+            out_printf(STDOUT_FILENO, "%s\n", cwd);
+        }
+        free(cwd);
+    }
+}
+
+void builtin_pwd(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        out_printf(STDERR_FILENO, "ERROR: pwd: %s\n", strerror(errno));
+        last_status = 1; 
+        return; 
+    }
+    out_printf(STDOUT_FILENO, "%s\n", cwd);
+    free(cwd);
+}
+
+void builtin_echo(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    int i = 1; 
+    bool newline = true; 
+    if (toks[1] && strcmp(toks[1], "-n") == 0) {
+        newline = false; 
+        i++; 
+    }
+    for (int first = i; toks[i]; i++) {
+        // a quoted "|" is an ordinary word, only the real operator is PIPE_SEP
+        out_printf(STDOUT_FILENO, "%s%s", i > first ? " " : "", toks[i]);
+    }
+    if (newline) {
+        out_puts(STDOUT_FILENO, "\n");
+    }
+}
+
+void builtin_true(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    last_status = 0; 
+}
+
+void builtin_false(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    last_status = 1; 
+}
+
+// export NAME=VALUE sets it for every later job; a bare export lists the environment
+void builtin_export(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] == NULL) {
+        for (char **env = environ; *env; env++) {
+            out_printf(STDOUT_FILENO, "export %s\n", *env);
+        }
+        return; 
+    }
+    for (int i = 1; toks[i]; i++) {
+        const char *eq = strchr(toks[i], '=');
+        size_t len = eq ? (size_t)(eq - toks[i]) : strlen(toks[i]);
+        bool valid = len > 0 && !(toks[i][0] >= '0' && toks[i][0] <= '9'); 
+        for (size_t k = 0; k < len && valid; k++) {
+            char c = toks[i][k];
+            valid = c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'); 
+        }
+        if (!valid) {
+            out_printf(STDERR_FILENO, "ERROR: export: bad name %s\n", toks[i]);
+            last_status = 1; 
+        } else if (eq) {
+            char name[len + 1];
+            memcpy(name, toks[i], len);
+            name[len] = '\0'; 
+            setenv(name, eq + 1, 1);
+        }
+        // NAME alone: anything already set is already exported
+    }
+}
+
+// wait [-n] [%jid|pid ...]: one epoll_wait over every job's pidfd until the targets are done;
+// without targets that means every running job, and ^C gives up early
+void builtin_wait(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    int i = 1; 
+    bool any = false; 
+    if (toks[1] && strcmp(toks[1], "-n") == 0) {
+        any = true; 
+        i++; 
+    }
+    sigset_t old; 
+    sigprocmask(SIG_BLOCK, &wait_mask, &old);
+    // exits that already happened count, so collect them without dropping the jobs
+    while (wait_events(0) > 0);
+    wait_remaining = 0; 
+    wait_next = NULL; 
+    bool targets = toks[i] != NULL; 
+    job_t *last = NULL; // the last operand decides the status of a plain wait
+    if (!targets) {
+        for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+            if (curr->exited && any && !wait_next) {
+                wait_next = curr; // ended since the last command, not reported by a wait yet
+            } else if (!curr->exited && !curr->suspended) {
+                curr->waited = true; 
+                wait_remaining++; 
+            }
+        }
+    }
+    for (; toks[i]; i++) {
+        last = lookup_job_arg("wait", toks[i]);
+        if (!last) {
+            continue; 
+        }
+        if (last->exited) {
+            if (!wait_next) {
+                wait_next = last; 
+            }
+        } else if (!last->waited) {
+            last->waited = true; 
+            wait_remaining++; 
+        }
+    }
+    fg = true; 
+    while (wait_remaining > 0 && !(any && wait_next) && !flag_c && !flag_q) {
+        wait_events(-1);
+        flag_z = false; // there is no foreground job to stop
+    }
+    fg = false; 
+    if (flag_c || flag_q) {
+        last_status = 128 + (flag_c ? SIGINT : SIGQUIT); 
+        flag_c = false; 
+        flag_q = false; 
+    } else if (any) {
+        last_status = wait_next ? job_exit_code(wait_next) : 127; 
+    } else if (targets) {
+        last_status = last ? job_exit_code(last) : 127; 
+    } else {
+        last_status = 0; 
+    }
+    if (any && wait_next) {
+        drop_job(wait_next); // so the next wait -n moves on to another job
+    }
+    // ^C or -n can leave targets behind
+    for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+        curr->waited = false; 
+    }
+    wait_remaining = 0; 
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+hist_t *stats_hists[] = { &hist_spawn, &hist_reap, &hist_dispatch, &hist_clean };
+#define NHISTS (sizeof(stats_hists) / sizeof(stats_hists[0]))
+
+void stats_reset() {
+    stat_commands = stat_builtins = stat_spawned = stat_spawn_errors = stat_reaped = stat_cleaned = 0; 
+    for (size_t i = 0; i < NHISTS; i++) {
+        hist_t *h = stats_hists[i]; 
+        h->count = h->sum = h->max = 0; 
+        memset(h->buckets, 0, sizeof(h->buckets));
+    }
+    stats_since = now_ns(); 
+}
+
+void stats_print_text(int fd) {
+    out_printf(fd, "stats %s  since %.1fs  commands %lu  builtins %lu  spawned %lu  spawn errors %lu  reaped %lu  cleaned %lu\n",
+               stats_on ? "on" : "off", (now_ns() - stats_since) / 1e9, stat_commands, stat_builtins,
+               stat_spawned, stat_spawn_errors, stat_reaped, stat_cleaned);
+    out_printf(fd, "%-10s %8s %10s %10s %10s %10s %10s %10s\n", "us", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (size_t i = 0; i < NHISTS; i++) {
+        hist_t *h = stats_hists[i]; 
+        out_printf(fd, "%-10s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", h->name, h->count,
+                   h->count ? h->sum / 1e3 / h->count : 0.0, hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.9) / 1e3,
+                   hist_quantile(h, 0.99) / 1e3, hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+}
+
+void stats_print_json(int fd) {
+    out_printf(fd, "{\"uptime_s\":%.3f,\"commands\":%lu,\"builtins\":%lu,\"spawned\":%lu,\"spawn_errors\":%lu,\"reaped\":%lu,\"cleaned\":%lu,\"jobs\":%zu",
+               (now_ns() - stats_since) / 1e9, stat_commands, stat_builtins, stat_spawned, stat_spawn_errors,
+               stat_reaped, stat_cleaned, jobs->by_jid.count);
+    for (size_t i = 0; i < NHISTS; i++) {
+        hist_t *h = stats_hists[i]; 
+        out_printf(fd, ",\"%s_us\":{\"count\":%lu,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+                   h->name, h->count, h->count ? h->sum / 1e3 / h->count : 0.0, hist_quantile(h, 0.5) / 1e3,
+                   hist_quantile(h, 0.9) / 1e3, hist_quantile(h, 0.99) / 1e3, hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+    out_puts(fd, "}\n");
+}
+
+// counters as counters, histograms as summaries: 900-odd le buckets each would swamp a scrape
+void stats_print_prom(int fd) {
+    struct { const char *name; unsigned long value; } counters[] = {
+        { "commands", stat_commands }, { "builtins", stat_builtins }, { "spawned", stat_spawned },
+        { "spawn_errors", stat_spawn_errors }, { "reaped", stat_reaped }, { "cleaned", stat_cleaned },
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        out_printf(fd, "# TYPE crash_%s_total counter\ncrash_%s_total %lu\n", counters[i].name, counters[i].name, counters[i].value);
+    }
+    out_printf(fd, "# TYPE crash_jobs gauge\ncrash_jobs %zu\n", jobs->by_jid.count);
+    const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (size_t i = 0; i < NHISTS; i++) {
+        hist_t *h = stats_hists[i]; 
+        out_printf(fd, "# HELP crash_%s_seconds %s\n# TYPE crash_%s_seconds summary\n", h->name, h->help, h->name);
+        for (size_t k = 0; k < sizeof(qs) / sizeof(qs[0]); k++) {
+            out_printf(fd, "crash_%s_seconds{quantile=\"%g\"} %.9f\n", h->name, qs[k], hist_quantile(h, qs[k]) / 1e9);
+        }
+        out_printf(fd, "crash_%s_seconds_sum %.9f\ncrash_%s_seconds_count %lu\n", h->name, h->sum / 1e9, h->name, h->count);
+    }
+}
+
+// write the whole file next to stats_path and rename it over, so readers never see half of one
+void stats_dump() {
+    uint64_t expirations; 
+    read(stats_timer, &expirations, sizeof(expirations));
+    if (!stats_path) {
+        return; 
+    }
+    out_flush();
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", stats_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return; // tried again at the next tick
+    }
+    if (stats_prom) {
+        stats_print_prom(fd);
+    } else {
+        stats_print_json(fd);
+    }
+    out_flush();
+    close(fd);
+    rename(tmp, stats_path);
+}
+
+// stats dump [-i SECS] [-p] FILE: rewrite FILE every SECS (default 10) in JSON, or Prometheus
+// text with -p; stats dump off stops it
+void stats_dump_start(const char **toks) {
+    double secs = 10; 
+    bool prom = false; 
+    int i = 2; 
+    for (; toks[i] && toks[i][0] == '-'; i++) {
+        if (strcmp(toks[i], "-p") == 0) {
+            prom = true; 
+        } else if (strcmp(toks[i], "-i") == 0 && toks[i + 1] && parse_duration(toks[i + 1], &secs) && secs > 0) {
+            i++; 
+        } else {
+            break; 
+        }
+    }
+    bool off = toks[i] && strcmp(toks[i], "off") == 0 && !toks[i + 1]; 
+    if (!toks[i] || toks[i + 1] || (off && i > 2)) {
+        out_puts(STDERR_FILENO, "ERROR: usage: stats dump [-i SECS] [-p] FILE | stats dump off\n");
+        last_status = 2; 
+        return; 
+    }
+    free(stats_path);
+    stats_path = NULL; 
+    if (stats_timer == -1) {
+        stats_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (stats_timer == -1) {
+            out_printf(STDERR_FILENO, "ERROR: %s\n", strerror(errno));
+            last_status = 1; 
+            return; 
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_DATA(EV_STATS, 0) };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, stats_timer, &ev);
+    }
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    if (!off) {
+        stats_path = strdup(toks[i]);
+        stats_prom = prom; 
+        if (!stats_on) {
+            stats_on = true; 
+            stats_reset();
+        }
+        its.it_interval.tv_sec = (time_t)secs; 
+        its.it_interval.tv_nsec = (long)((secs - (time_t)secs) * 1e9);
+        its.it_value = its.it_interval; 
+    }
+    timerfd_settime(stats_timer, 0, &its, NULL);
+}
+
+// stats [-j|-p]: the shell's own counters and latencies, as a table, JSON or Prometheus text;
+// stats on|off|reset, and stats dump (see above)
+void builtin_stats(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] == NULL) {
+        stats_print_text(STDOUT_FILENO);
+    } else if (strcmp(toks[1], "dump") == 0) {
+        stats_dump_start(toks);
+    } else if (toks[2] != NULL) {
+        out_puts(STDERR_FILENO, "ERROR: usage: stats [-j|-p|on|off|reset|dump ...]\n");
+        last_status = 2; 
+    } else if (strcmp(toks[1], "-j") == 0) {
+        stats_print_json(STDOUT_FILENO);
+    } else if (strcmp(toks[1], "-p") == 0) {
+        stats_print_prom(STDOUT_FILENO);
+    } else if (strcmp(toks[1], "on") == 0) {
+        if (!stats_on) {
+            stats_reset();
+        }
+        stats_on = true; 
+    } else if (strcmp(toks[1], "off") == 0) {
+        stats_on = false; 
+    } else if (strcmp(toks[1], "reset") == 0) {
+        stats_reset();
+    } else {
+        out_puts(STDERR_FILENO, "ERROR: usage: stats [-j|-p|on|off|reset|dump ...]\n");
+        last_status = 2; 
+    }
+}
+
+// a job from the state file whose leader still runs, under the jid it had if that is free
+void state_adopt(const state_rec_t *rec) {
+    pid_t leader = rec->pids[0]; 
+    if (leader <= 0 || rec->start_ticks == 0 || proc_start_ticks(leader) != rec->start_ticks) {
+        return; // ended while no shell watched, or the pid went to something else
+    }
+    char name[sizeof(rec->name) + 1];
+    memcpy(name, rec->name, sizeof(rec->name));
+    name[sizeof(rec->name)] = '\0'; 
+    if (rec->jid > jobs->curr_jid) {
+        jobs->curr_jid = rec->jid - 1; 
+    }
+    add_job(jobs, name, 0);
+    job_t *job = get_last_job(jobs);
+    job->adopted = true; 
+    // its wall time counts from when the leader started, not from now; starttime runs on the boot
+    // clock, which unlike the monotonic one goes on through suspend, so go by the age instead
+    struct timespec boot; 
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    int64_t age_ns = (int64_t)boot.tv_sec * 1000000000 + boot.tv_nsec -
+                     (int64_t)(rec->start_ticks * 1e9 / sysconf(_SC_CLK_TCK));
+    int64_t start_ns = (int64_t)job->start.tv_sec * 1000000000 + job->start.tv_nsec - (age_ns > 0 ? age_ns : 0);
+    if (start_ns < 0) {
+        start_ns = 0; 
+    }
+    job->start.tv_sec = start_ns / 1000000000; 
+    job->start.tv_nsec = start_ns % 1000000000; 
+    job->end = job->start; 
+    add_pid(job, leader);
+    for (int i = 1; i < rec->npids && i < STATE_PIDS; i++) {
+        if (getpgid(rec->pids[i]) == leader) {
+            add_pid(job, rec->pids[i]);
+        }
+    }
+    set_job_suspended(job, rec->suspended);
+    out_printf(STDOUT_FILENO, "[%d] (%d)  %s  %s\n", job->jid, job->pid, rec->suspended ? "adopted suspended" : "adopted", job->name);
+    if (job->pidfd == -1) {
+        job->nlive++; // adopted_exit counts the leader as the stage it was watching
+        adopted_exit(job);
+    }
+}
+
+int state_cmp(const void *a, const void *b) {
+    return ((const state_rec_t *)a)->jid - ((const state_rec_t *)b)->jid; 
+}
+
+void state_close() {
+    if (!state_hdr) {
+        return; 
+    }
+    munmap(state_hdr, sizeof(state_hdr_t) + state_hdr->cap * sizeof(state_rec_t));
+    close(state_fd);
+    state_hdr = NULL; 
+    state_fd = -1; 
+    nstate_free = 0; 
+    for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+        curr->state_slot = -1; 
+    }
+}
+
+// mirror the job table into path from now on, first taking over the jobs a dead shell left in it
+bool state_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        out_printf(STDERR_FILENO, "ERROR: cannot open %s: %s\n", path, strerror(errno));
+        return false; 
+    }
+    // held until we exit, however we exit, so a live shell's file is never taken over
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        out_printf(STDERR_FILENO, "ERROR: %s is in use by another shell\n", path);
+        close(fd);
+        return false; 
+    }
+    state_close();
+    state_fd = fd; 
+    struct stat st; 
+    state_rec_t *left = NULL; 
+    size_t nleft = 0; 
+    int32_t old_jid = 0; 
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(state_hdr_t)) {
+        state_hdr_t *old = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (old != MAP_FAILED && memcmp(old->magic, STATE_MAGIC, 8) == 0 &&
+            sizeof(state_hdr_t) + (size_t)old->cap * sizeof(state_rec_t) <= (size_t)st.st_size) {
+            const state_rec_t *recs = (const state_rec_t *)(old + 1);
+            left = malloc(old->cap * sizeof(state_rec_t) + 1);
+            assert(left);
+            for (uint32_t i = 0; i < old->cap; i++) {
+                if (recs[i].jid > 0) {
+                    left[nleft++] = recs[i]; 
+                }
+            }
+            old_jid = old->curr_jid; 
+        }
+        if (old != MAP_FAILED) {
+            munmap(old, st.st_size);
+        }
+    }
+    state_hdr = MAP_FAILED; 
+    if (ftruncate(fd, 0) == 0 && ftruncate(fd, sizeof(state_hdr_t)) == 0) {
+        state_hdr = mmap(NULL, sizeof(state_hdr_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (state_hdr == MAP_FAILED || (memcpy(state_hdr->magic, STATE_MAGIC, 8), !state_grow())) {
+        out_printf(STDERR_FILENO, "ERROR: cannot map %s: %s\n", path, strerror(errno));
+        if (state_hdr != MAP_FAILED) {
+            munmap(state_hdr, sizeof(state_hdr_t));
+        }
+        state_hdr = NULL; 
+        close(fd);
+        state_fd = -1; 
+        free(left);
+        return false; 
+    }
+    for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+        if (!curr->exited) {
+            state_sync(curr);
+        }
+    }
+    // in jid order, which is the order the job list keeps
+    qsort(left, nleft, sizeof(state_rec_t), state_cmp);
+    for (size_t i = 0; i < nleft; i++) {
+        state_adopt(&left[i]);
+    }
+    free(left);
+    if (old_jid > jobs->curr_jid) {
+        jobs->curr_jid = old_jid; 
+    }
+    state_hdr->curr_jid = jobs->curr_jid; 
+    free(state_path);
+    state_path = strdup(path);
+    return true; 
+}
+
+// state [PATH|off]: keep the job table in PATH, so a shell started on it after this one dies
+// takes over the jobs still running; bare, says where it goes
+void builtin_state(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] == NULL) {
+        if (state_hdr) {
+            out_printf(STDOUT_FILENO, "state %s  %u jobs  %u slots\n", state_path, state_hdr->cap - nstate_free, state_hdr->cap);
+        } else {
+            out_puts(STDOUT_FILENO, "state off\n");
+        }
+    } else if (toks[2] != NULL) {
+        out_puts(STDERR_FILENO, "ERROR: usage: state [PATH|off]\n");
+        last_status = 2; 
+    } else if (strcmp(toks[1], "off") == 0) {
+        // a file nobody updates would hand the next shell a stale table
+        if (state_hdr) {
+            unlink(state_path);
+        }
+        state_close();
+    } else if (!state_open(toks[1])) {
+        last_status = 1; 
+    }
+}
+
+// subreaper [on|off]: have what jobs leave behind (daemons, orphaned grandchildren) reparented to
+// the shell instead of init, so they are reaped here; bare, it lists the ones still running
+void builtin_subreaper(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] == NULL) {
+        out_printf(STDOUT_FILENO, "subreaper %s  %lu orphans reaped\n", subreaper_mode ? "on" : "off", orphans_reaped);
+        char path[64], buf[4096];
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/children", getpid(), getpid());
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t n = fd == -1 ? -1 : read(fd, buf, sizeof(buf) - 1);
+        if (fd != -1) {
+            close(fd);
+        }
+        buf[n > 0 ? n : 0] = '\0'; 
+        for (char *p = buf, *endptr; *p; p = endptr) {
+            pid_t pid = strtol(p, &endptr, 10);
+            if (endptr == p) {
+                break; 
+            }
+            if (get_job_pid(pid)) {
+                continue; 
+            }
+            char comm[64] = "?";
+            snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+            ssize_t len = fd == -1 ? -1 : read(fd, comm, sizeof(comm) - 1);
+            if (fd != -1) {
+                close(fd);
+            }
+            if (len > 0) {
+                comm[comm[len - 1] == '\n' ? len - 1 : len] = '\0'; 
+            }
+            out_printf(STDOUT_FILENO, "(%d)  orphan  %s\n", pid, comm);
+        }
+    } else if (toks[2] == NULL && (strcmp(toks[1], "on") == 0 || strcmp(toks[1], "off") == 0)) {
+        bool on = strcmp(toks[1], "on") == 0; 
+        if (prctl(PR_SET_CHILD_SUBREAPER, on ? 1 : 0) == -1) {
+            out_printf(STDERR_FILENO, "ERROR: %s\n", strerror(errno));
+            last_status = 1; 
+            return; 
+        }
+        subreaper_mode = on; 
+    } else {
+        out_puts(STDERR_FILENO, "ERROR: usage: subreaper [on|off]\n");
+        last_status = 2; 
+    }
+}
+
+// capture [on|off]: whether later background jobs (and parallel tasks) write to a joblog
+void builtin_capture(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    if (toks[1] == NULL) {
+        out_printf(STDOUT_FILENO, "capture %s\n", capture_mode ? "on" : "off");
+    } else if (toks[2] == NULL && (strcmp(toks[1], "on") == 0 || strcmp(toks[1], "off") == 0)) {
+        capture_mode = strcmp(toks[1], "on") == 0; 
+    } else {
+        out_puts(STDERR_FILENO, "ERROR: usage: capture [on|off]\n");
+        last_status = 2; 
+    }
+}
+
+// joblog [-f] %jid: what a captured job wrote, the last CRASH_LOG_SIZE bytes of it;
+// -f keeps printing until the job closes its output (or ^C)
+void builtin_joblog(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    int i = 1; 
+    bool follow = toks[1] && strcmp(toks[1], "-f") == 0; 
+    if (follow) {
+        i++; 
+    }
+    if (!toks[i] || toks[i + 1]) {
+        out_puts(STDERR_FILENO, "ERROR: usage: joblog [-f] %jid\n");
+        last_status = 2; 
+        return; 
+    }
+    // logs outlive their jobs, so only job ids make sense here
+    const char *str = toks[i][0] == '%' ? toks[i] + 1 : toks[i];
+    char *endptr; 
+    long jid = strtol(str, &endptr, 10);
+    sigset_t old; 
+    sigprocmask(SIG_BLOCK, &wait_mask, &old);
+    while (wait_events(0) > 0); // pick up whatever is sitting in the pipe
+    joblog_t *log = endptr != str && *endptr == '\0' ? joblog_find(jid) : NULL; 
+    if (!log) {
+        out_printf(STDERR_FILENO, "ERROR: no log for job %s\n", str);
+        last_status = 1; 
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return; 
+    }
+    uint64_t at = joblog_print(log, 0);
+    fg = true; 
+    while (follow && log && log->fd != -1 && !flag_c && !flag_q) {
+        wait_events(-1);
+        flag_z = false; 
+        log = joblog_find(jid); // may have been dropped meanwhile
+        if (log) {
+            at = joblog_print(log, at);
+        }
+    }
+    fg = false; 
+    flag_c = false; 
+    flag_q = false; 
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void builtin_serve(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg);
+void builtin_after(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg);
+
+typedef void (*builtin_fn)(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg);
+
+#define IS(name, fn) (strcmp(cmd, name) == 0 ? fn : NULL)
+
+// a switch on the first byte leaves at most two names to compare (three for t and s)
+builtin_fn find_builtin(const char *cmd) {
+    switch (cmd[0]) {
+    case 'a': return IS("after", builtin_after);
+    case 'b': return IS("bg", builtin_bg);
+    case 'c': return cmd[1] == 'd' ? IS("cd", builtin_cd) : cmd[1] == 'g' ? IS("cgroup", builtin_cgroup) : IS("capture", builtin_capture);
+    case 'd': return IS("deadline", builtin_deadline);
+    case 'e': return cmd[1] == 'c' ? IS("echo", builtin_echo) : IS("export", builtin_export);
+    case 'f': return cmd[1] == 'g' ? IS("fg", builtin_fg) : IS("false", builtin_false);
+    case 'h': return IS("hash", builtin_hash);
+    case 'j': return cmd[1] == 'o' && cmd[2] == 'b' && cmd[3] == 's' ? IS("jobs", builtin_jobs) : IS("joblog", builtin_joblog);
+    case 'l': return IS("limit", builtin_prefix);
+    case 'n': return IS("nuke", builtin_nuke);
+    case 'p': return cmd[1] == 'w' ? IS("pwd", builtin_pwd) : cmd[1] == 'l' ? IS("place", builtin_place) : IS("parallel", builtin_parallel);
+    case 'q': return IS("quit", builtin_quit);
+    case 's': return cmd[1] == 'e' ? IS("serve", builtin_serve) : cmd[1] == 'u' ? IS("subreaper", builtin_subreaper) :
+                     strcmp(cmd, "stats") == 0 ? builtin_stats : IS("state", builtin_state);
+    case 't': return cmd[1] == 'r' ? IS("true", builtin_true) : strcmp(cmd, "time") == 0 ? builtin_prefix : IS("timeout", builtin_prefix);
+    case 'w': return IS("wait", builtin_wait);
+    }
+    return NULL; 
+}
+
+#undef IS
+
+// builtins whose arguments end in a command to launch, which may be a pipeline
+bool takes_command(builtin_fn fn) {
+    return fn == builtin_prefix || fn == builtin_place || fn == builtin_parallel || fn == builtin_after; 
+}
+
+void eval(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) { // bg is true iff command ended with &
+    assert(toks);
+    if (*toks == NULL) return;
+    last_status = 0; 
+    if (stats_on) {
+        stat_commands++; 
+        dispatch_ns = now_ns(); 
+    }
+    builtin_fn fn = find_builtin(toks[0]);
+    if (fn && !takes_command(fn)) {
+        // the shell cannot feed a pipe from its own process, so pipelines run the real program
+        for (int i = 1; toks[i]; i++) {
+            if (toks[i] == PIPE_SEP) {
+                fn = NULL; 
+                break; 
+            }
+        }
+    }
+    if (fn) {
+        stat_builtins += stats_on; 
+        fn(toks, bg, act, act_fg);
+    } else {
+        job_opts_t opts = { .timed = false };
+        run_job(toks, bg, &opts, act, act_fg);
+    }
+    dispatch_ns = 0; 
+}
+
+// what start_job leaves to its caller: the time report and the timeout
+void apply_opts(job_t *job, const job_opts_t *opts) {
+    job->timed = opts->timed; 
+    job->kill_after = opts->kill_after; 
+    if (opts->timeout > 0) {
+        set_deadline(job, ts_after(&job->start, opts->timeout));
+    }
+}
+
+// launch toks as a job, then either announce it (bg) or wait for it; timed jobs report their usage at the end
+void run_job(const char **toks, bool bg, const job_opts_t *opts, struct sigaction *act, struct sigaction *act_fg) {
+    if (jobs_full()) {
+        out_puts(STDERR_FILENO, "ERROR: too many jobs\n");
+        return; 
+    }
+    sigprocmask(SIG_BLOCK, &(act->sa_mask), NULL);  
+    if (!bg) {
+        fg = true;
+    }
+    job_t *job = start_job(toks, capture_mode && bg, opts, act, act_fg);
+    if (job) {
+        apply_opts(job, opts);
+    }
+    if (stats_on && job && dispatch_ns) {
+        hist_record(&hist_dispatch, now_ns() - dispatch_ns);
+    }
+    if (job == NULL) {
+        // start_job already complained
+    } else if (bg) {
+        out_printf(STDOUT_FILENO, "[%d] (%d)  running  %s\n", job->jid, job->pid, job->name);
+    } else {
+        int status;
+        wait_fg(job, &status);
+        print_status(job->pid, job->name);
+    }
+    fg = false; 
+    sigprocmask(SIG_UNBLOCK, &(act->sa_mask), NULL);
+}
+
+// toks copied into one block that outlives the line, PIPE_SEP kept as the same pointer
+char **copy_toks(const char **toks) {
+    size_t n = 0, bytes = 0; 
+    for (; toks[n]; n++) {
+        if (toks[n] != PIPE_SEP) {
+            bytes += strlen(toks[n]) + 1; 
+        }
+    }
+    char **copy = malloc((n + 1) * sizeof(char *) + bytes);
+    assert(copy);
+    char *p = (char *)(copy + n + 1);
+    for (size_t i = 0; i < n; i++) {
+        if (toks[i] == PIPE_SEP) {
+            copy[i] = (char *)PIPE_SEP; 
+        } else {
+            copy[i] = strcpy(p, toks[i]);
+            p += strlen(p) + 1; 
+        }
+    }
+    copy[n] = NULL; 
+    return copy; 
+}
+
+// a waiting job for toks, to be started by the scheduler once its dependencies (none yet) are done
+job_t *sched_node_new(const char **toks, const job_opts_t *opts, struct sigaction *act, struct sigaction *act_fg) {
+    add_job(jobs, pipeline_name(toks), 0);
+    job_t *job = get_last_job(jobs);
+    sched_node_t *node = calloc(1, sizeof(sched_node_t));
+    assert(node);
+    node->argv = copy_toks(toks);
+    node->opts = *opts; 
+    node->act = act; 
+    node->act_fg = act_fg; 
+    node->job = job; 
+    job->node = node; 
+    return job; 
+}
+
+// job's node runs once dep has ended
+void sched_depend(job_t *job, job_t *dep) {
+    if ((dep->ndependents & (dep->ndependents - 1)) == 0) {
+        // at every power of two
+        dep->dependents = realloc(dep->dependents, (dep->ndependents ? dep->ndependents * 2 : 1) * sizeof(int));
+        assert(dep->dependents);
+    }
+    dep->dependents[dep->ndependents++] = job->jid; 
+    job->node->deps++; 
+}
+
+void sched_node_free(job_t *job) {
+    free(job->node->argv);
+    free(job->node);
+    job->node = NULL; 
+}
+
+// the node will not run: it ends with the wait status status, which passes on to whatever runs after it
+void sched_skip(job_t *job, int status, bool quiet) {
+    sched_node_free(job);
+    job->status = status; 
+    job->notified = true; 
+    if (!quiet) {
+        out_printf(STDOUT_FILENO, "[%d] (-)  skipped  %s\n", job->jid, job->name);
+    }
+    mark_exited(job);
+    if (job->ctl_waits > 0) {
+        ctl_job_done(job);
+    }
+    if (job->ndependents > 0) {
+        sched_job_done(job);
+    }
+}
+
+void sched_dispatch(); 
+
+// its dependencies are done: queue it, or skip it if && or || says so
+void sched_decide(job_t *job) {
+    sched_node_t *node = job->node; 
+    if ((node->dep_status != 0) != node->on_failure) {
+        sched_skip(job, node->dep_status, false);
+        return; 
+    }
+    node->ready = true; 
+    if (ready_tail) {
+        ready_tail->next_ready = node; 
+    } else {
+        ready_head = node; 
+    }
+    ready_tail = node; 
+}
+
+// nuke or a timeout got to a node before it started
+void sched_cancel(job_t *job, int status) {
+    if (job->node->ready) {
+        sched_node_t **link = &ready_head; 
+        ready_tail = NULL; 
+        while (*link) {
+            if (*link == job->node) {
+                *link = job->node->next_ready; 
+            } else {
+                ready_tail = *link; 
+                link = &(*link)->next_ready; 
+            }
+        }
+    }
+    sched_skip(job, status, true);
+}
+
+void sched_start(job_t *job) {
+    sched_node_t *node = job->node; 
+    arena_mark_t mark = arena_mark(&line_arena);
+    job->node = NULL; 
+    clock_gettime(CLOCK_MONOTONIC, &job->start); // its wall time and timeout count from here
+    spawn_stages(job, (const char **)node->argv, capture_mode, &node->opts, node->act, node->act_fg);
+    arena_release(&line_arena, mark);
+    if (job->npids == 0) {
+        job->node = node; 
+        sched_skip(job, 127 << 8, true); // spawn_stages said why
+        return; 
+    }
+    apply_opts(job, &node->opts);
+    job->scheduled = true; 
+    sched_running++; 
+    out_printf(STDOUT_FILENO, "[%d] (%d)  running  %s\n", job->jid, job->pid, job->name);
+    free(node->argv);
+    free(node);
+}
+
+// start ready nodes, oldest first, while there is room under sched_limit
+void sched_dispatch() {
+    while (ready_head && (sched_limit == 0 || sched_running < sched_limit)) {
+        sched_node_t *node = ready_head; 
+        ready_head = node->next_ready; 
+        if (!ready_head) {
+            ready_tail = NULL; 
+        }
+        node->ready = false; 
+        sched_start(node->job);
+    }
+}
+
+// job ended: pass its status on to the nodes after it, and its slot to the next ready one
+void sched_job_done(job_t *job) {
+    int status = job_wait_status(job);
+    int *dependents = job->dependents; 
+    int n = job->ndependents; 
+    job->dependents = NULL; 
+    job->ndependents = 0; 
+    for (int i = 0; i < n; i++) {
+        job_t *next = get_job_jid(dependents[i]);
+        if (!next || !next->node) {
+            continue; // cancelled meanwhile
+        }
+        if (status != 0 && next->node->dep_status == 0) {
+            next->node->dep_status = status; 
+        }
+        if (--next->node->deps == 0) {
+            sched_decide(next);
+        }
+    }
+    free(dependents);
+    if (job->scheduled) {
+        job->scheduled = false; 
+        sched_running--; 
+    }
+    sched_dispatch();
+}
+
+// `a && b || c &`: every part a node, each one after the part before it
+void sched_chain(cmd_t *cmds, int n, struct sigaction *act, struct sigaction *act_fg) {
+    job_opts_t *opts = arena_alloc(&line_arena, n * sizeof(job_opts_t));
+    const char ***toks = arena_alloc(&line_arena, n * sizeof(char **));
+    // all or nothing: check every part before any of it is queued
+    for (int k = 0; k < n; k++) {
+        opts[k] = (job_opts_t){ .timed = false };
+        int i = parse_prefixes(cmds[k].toks, &opts[k]);
+        if (i < 0) {
+            return; 
+        }
+        toks[k] = &cmds[k].toks[i];
+        if (toks[k][0] == NULL) {
+            out_printf(STDERR_FILENO, "ERROR: %s needs a command\n", cmds[k].toks[0]);
+            last_status = 2; 
+            return; 
+        }
+        if (!pipeline_ok(toks[k])) {
+            return; 
+        }
+    }
+    int first = jobs->curr_jid + 1; 
+    job_t *prev = NULL; 
+    for (int k = 0; k < n; k++) {
+        job_t *job = sched_node_new(toks[k], &opts[k], act, act_fg);
+        if (prev) {
+            job->node->on_failure = cmds[k - 1].op == CMD_OR; 
+            sched_depend(job, prev);
+        } else {
+            sched_decide(job);
+        }
+        prev = job; 
+    }
+    sched_dispatch();
+    for (int jid = first; jid < first + n; jid++) {
+        job_t *job = get_job_jid(jid);
+        if (job && job->node) {
+            out_printf(STDOUT_FILENO, "[%d] (-)  waiting  %s\n", job->jid, job->name);
+        }
+    }
+}
+
+// after [-j N] %jid... cmd: run cmd once every listed job has ended, if they all succeeded (otherwise
+// it is skipped, and so is whatever runs after it); with & it only gets queued, without it we wait
+// for it; -j caps how many such jobs run at once, `after -j N` alone just sets that
+void builtin_after(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    int i = 1; 
+    if (toks[1] && strcmp(toks[1], "-j") == 0) {
+        char *endptr; 
+        long limit = toks[2] ? strtol(toks[2], &endptr, 10) : -1; 
+        if (!toks[2] || *endptr != '\0' || limit < 0 || limit > INT_MAX) {
+            out_puts(STDERR_FILENO, "ERROR: after -j needs a number of jobs, 0 for no limit\n");
+            last_status = 2; 
+            return; 
+        }
+        sched_limit = limit; 
+        sched_dispatch();
+        i = 3; 
+        if (toks[i] == NULL) {
+            return; 
+        }
+    }
+    if (toks[i] == NULL) {
+        int waiting = 0; 
+        for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+            waiting += curr->node != NULL; 
+        }
+        out_printf(STDOUT_FILENO, "after: %d waiting, %d running, limit %d\n", waiting, sched_running, sched_limit);
+        return; 
+    }
+    int ndeps = 0; 
+    while (toks[i + ndeps] && toks[i + ndeps][0] == '%') {
+        ndeps++; 
+    }
+    // what each dependency ended with (a wait status), or -1 while it runs
+    int *dep_status = arena_alloc(&line_arena, (ndeps + 1) * sizeof(int));
+    for (int k = 0; k < ndeps; k++) {
+        const char *str = toks[i + k] + 1; 
+        char *endptr; 
+        long jid = strtol(str, &endptr, 10);
+        job_t *dep = endptr != str && *endptr == '\0' ? get_job_jid(jid) : NULL; 
+        if (dep) {
+            dep_status[k] = dep->exited ? job_wait_status(dep) : -1; 
+        } else if (endptr != str && *endptr == '\0' && jid > 0 && done_ring[jid % DONE_KEEP].jid == jid) {
+            dep_status[k] = done_ring[jid % DONE_KEEP].status; 
+        } else {
+            out_printf(STDERR_FILENO, "ERROR: no job %s\n", str);
+            last_status = 127; 
+            return; 
+        }
+    }
+    job_opts_t opts = { .timed = false };
+    int k = ndeps == 0 ? -1 : parse_prefixes(&toks[i + ndeps], &opts);
+    if (k < 0 || toks[i + ndeps + k] == NULL) {
+        if (k >= 0 || ndeps == 0) {
+            out_puts(STDERR_FILENO, "ERROR: usage: after [-j N] %jid... cmd\n");
+            last_status = 2; 
+        }
+        return; 
+    }
+    const char **cmd = &toks[i + ndeps + k];
+    if (!pipeline_ok(cmd)) {
+        return; 
+    }
+    job_t *job = sched_node_new(cmd, &opts, act, act_fg);
+    int jid = job->jid; 
+    for (int d = 0; d < ndeps; d++) {
+        if (dep_status[d] == -1) {
+            sched_depend(job, get_job_jid(strtol(toks[i + d] + 1, NULL, 10)));
+        } else if (dep_status[d] != 0 && job->node->dep_status == 0) {
+            job->node->dep_status = dep_status[d]; 
+        }
+    }
+    if (job->node->deps == 0) {
+        sched_decide(job);
+        sched_dispatch();
+    }
+    job = get_job_jid(jid);
+    if (bg) {
+        if (job && job->node) {
+            out_printf(STDOUT_FILENO, "[%d] (-)  waiting  %s\n", job->jid, job->name);
+        }
+        return; 
+    }
+    sigset_t old; 
+    sigprocmask(SIG_BLOCK, &wait_mask, &old);
+    fg = true; 
+    while (!job->exited && !flag_c && !flag_q) {
+        wait_events(-1);
+        flag_z = false; 
+    }
+    fg = false; 
+    if (flag_c || flag_q) {
+        signal_job(job, flag_c ? SIGINT : SIGQUIT);
+        last_status = 128 + (flag_c ? SIGINT : SIGQUIT); 
+        flag_c = false; 
+        flag_q = false; 
+    } else {
+        last_status = job_exit_code(job);
+        job->notified = true; 
+        drop_job(job);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// byte classes for the lexer, everything not listed is part of a word
+enum { LEX_WORD, LEX_SPACE, LEX_SEP, LEX_PIPE, LEX_SQUOTE, LEX_DQUOTE, LEX_ESC, LEX_END };
+
+static const unsigned char lex_class[256] = {
+    ['\0'] = LEX_END, 
+    [' '] = LEX_SPACE, ['\t'] = LEX_SPACE, ['\n'] = LEX_SPACE, 
+    [';'] = LEX_SEP, ['&'] = LEX_SEP, 
+    ['|'] = LEX_PIPE, 
+    ['\''] = LEX_SQUOTE, ['"'] = LEX_DQUOTE, ['\\'] = LEX_ESC, 
+};
+
+// split s into commands in one pass, unquoting words in place (they only ever shrink);
+// returns the number of commands, or -1 with an error printed if a quote is left open or && / || lacks a side
+int lex(char *s, cmd_t **cmds_out) {
+    size_t len = strlen(s);
+    // every token and every separator takes at least one byte of s
+    const char **toks = arena_alloc(&line_arena, (len + 1) * sizeof(char *));
+    cmd_t *cmds = arena_alloc(&line_arena, (len / 2 + 1) * sizeof(cmd_t));
+    int ncmds = 0; 
+    int t = 0; 
+    int first = 0; // first token of the command being built
+    char *r = s; 
+    char *w = s; 
+    int held = -1; // the delimiter after the last word, which its terminator may have overwritten
+    bool need_cmd = false; // the last command ended with && or ||, so another has to follow
+    while (true) {
+        char ch = held >= 0 ? held : *r; 
+        held = -1; 
+        unsigned char c = lex_class[(unsigned char)ch];
+        if (c == LEX_SPACE) {
+            r++; 
+            continue; 
+        }
+        if (c == LEX_PIPE && r[1] != '|') {
+            toks[t++] = PIPE_SEP; 
+            r++; 
+            continue; 
+        }
+        if (c == LEX_SEP || c == LEX_PIPE || c == LEX_END) {
+            // r still points at the delimiter when ch was held, so r[1] is what follows it either way
+            bool pair = (ch == '&' || ch == '|') && r[1] == ch; 
+            cmd_op_t op = pair ? (ch == '&' ? CMD_AND : CMD_OR) : ch == '&' ? CMD_BG : CMD_SEQ; 
+            if (t > first) {
+                toks[t++] = NULL; 
+                cmds[ncmds].toks = &toks[first];
+                cmds[ncmds].op = op; 
+                ncmds++; 
+                first = t; 
+                need_cmd = pair; 
+            } else if (pair || need_cmd) {
+                out_printf(STDERR_FILENO, "ERROR: syntax error near %s\n", c == LEX_END ? "end of line" : pair ? (ch == '&' ? "&&" : "||") : (ch == '&' ? "&" : ";"));
+                return -1; 
+            }
+            if (c == LEX_END) {
+                break; 
+            }
+            r += pair ? 2 : 1; 
+            continue; 
+        }
+        // a word: plain runs, quoted parts and escapes until the next space or operator
+        toks[t++] = w; 
+        while (true) {
+            char *run = r; 
+            while (lex_class[(unsigned char)*r] == LEX_WORD) {
+                r++; 
+            }
+            if (w != run) {
+                memmove(w, run, r - run);
+            }
+            w += r - run; 
+            c = lex_class[(unsigned char)*r];
+            if (c == LEX_ESC) {
+                if (r[1] != '\0') {
+                    r++; 
+                }
+                *w++ = *r++; 
+            } else if (c == LEX_SQUOTE) {
+                char *q = strchr(r + 1, '\''); 
+                if (!q) {
+                    out_puts(STDERR_FILENO, "ERROR: unterminated quote\n");
+                    return -1; 
+                }
+                memmove(w, r + 1, q - r - 1);
+                w += q - r - 1; 
+                r = q + 1; 
+            } else if (c == LEX_DQUOTE) {
+                r++; 
+                while (*r != '"') {
+                    if (*r == '\0') {
+                        out_puts(STDERR_FILENO, "ERROR: unterminated quote\n");
+                        return -1; 
+                    }
+                    // inside double quotes a backslash only escapes these
+                    if (*r == '\\' && r[1] != '\0' && strchr("\"\\$`", r[1])) {
+                        r++; 
+                    }
+                    *w++ = *r++; 
+                }
+                r++; 
+            } else {
+                break; 
+            }
+        }
+        // when nothing was unquoted the terminator lands on the delimiter, so keep that aside
+        held = (unsigned char)*r; 
+        *w++ = '\0'; 
+    }
+    *cmds_out = cmds; 
+    return ncmds; 
+}
 
-job_t *get_last_job(job_t *head) {
-    while(head->next) {
-        head = head->next; 
+// replies a client may have queued before we stop reading its requests
+#define CTL_OUT_MAX (1 << 20)
+// longest request line
+#define CTL_IN_MAX (1 << 16)
+
+void ctl_printf(ctl_client_t *c, const char *fmt, ...) {
+    va_list ap; 
+    va_start(ap, fmt);
+    int n = vsnprintf(c->out + c->out_len, c->out_cap - c->out_len, fmt, ap);
+    va_end(ap);
+    if ((size_t)n >= c->out_cap - c->out_len) {
+        while (c->out_cap - c->out_len <= (size_t)n) {
+            c->out_cap = c->out_cap ? c->out_cap * 2 : 4096; 
+        }
+        c->out = realloc(c->out, c->out_cap);
+        assert(c->out);
+        va_start(ap, fmt);
+        vsnprintf(c->out + c->out_len, c->out_cap - c->out_len, fmt, ap);
+        va_end(ap);
     }
-    return head; 
+    c->out_len += n; 
 }
 
-void add_job(job_list_t *jobs, const char *name, pid_t pid){
-    job_t *new_job = malloc(sizeof(job_t)); 
-    assert(new_job);
-    new_job->pid = pid; 
-    new_job->suspended = false; 
-    new_job->name = malloc(strlen(name) + 1);
-    assert(new_job->name);
-    strcpy(new_job->name, name);
-    new_job->next = NULL;  
-    if (jobs->curr_jid == 0) {
-        jobs->curr_jid = 1;
-        jobs->jobs_list = new_job; 
-        new_job->jid = 1; 
-    } else {
-        new_job->jid = jobs->curr_jid + 1; 
-        if (jobs->jobs_list != NULL) {
-            job_t *last_job = get_last_job(jobs->jobs_list);
-            last_job->next = new_job; 
+// s as a JSON string, quotes included
+void ctl_json_str(ctl_client_t *c, const char *s) {
+    ctl_printf(c, "\"");
+    for (; *s; s++) {
+        unsigned char ch = *s; 
+        if (ch == '"' || ch == '\\') {
+            ctl_printf(c, "\\%c", ch);
+        } else if (ch < 0x20) {
+            ctl_printf(c, "\\u%04x", ch);
+        } else {
+            ctl_printf(c, "%c", ch);
         }
-        if (jobs->jobs_list == NULL) {
-            jobs->jobs_list = new_job;
+    }
+    ctl_printf(c, "\"");
+}
+
+void ctl_error(ctl_client_t *c, const char *msg, const char *arg) {
+    ctl_printf(c, "{\"error\":");
+    if (arg) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%s%s", msg, arg);
+        ctl_json_str(c, buf);
+    } else {
+        ctl_json_str(c, msg);
+    }
+    ctl_printf(c, "}\n");
+}
+
+void ctl_close(ctl_client_t *c) {
+    for (int i = 0; i < c->nwait; i++) {
+        job_t *job = get_job_jid(c->wait_jids[i]);
+        if (job) {
+            job->ctl_waits--; 
         }
-        jobs->curr_jid++; 
     }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    ctl_clients[c->slot] = NULL; 
+    ctl_live--; 
+    free(c->in);
+    free(c->out);
+    free(c->wait_jids);
+    free(c);
 }
 
-int get_curr_jid(job_list_t *jobs) {
-    job_t *list = jobs->jobs_list;
-    job_t *last_job = get_last_job(list); 
-    return last_job->jid; 
+void ctl_wait_for(ctl_client_t *c, job_t *job) {
+    if (c->nwait == c->wait_cap) {
+        c->wait_cap = c->wait_cap ? c->wait_cap * 2 : 8; 
+        c->wait_jids = realloc(c->wait_jids, c->wait_cap * sizeof(int));
+        assert(c->wait_jids);
+    }
+    c->wait_jids[c->nwait++] = job->jid; 
+    job->ctl_waits++; 
 }
 
-void add_pid(job_list_t *jobs, pid_t pid){
-    job_t *last_job = get_last_job(jobs->jobs_list);
-    last_job->pid = pid; 
+// every job the pending request waited for is gone
+void ctl_finish(ctl_client_t *c) {
+    if (c->pending == CTL_WAIT) {
+        ctl_printf(c, "{\"status\":%d}\n", c->wait_status);
+    } else if (c->pending == CTL_NUKE) {
+        ctl_printf(c, "{\"killed\":%d}\n", c->wait_status);
+    } else if (c->pending == CTL_SPAWN) {
+        ctl_printf(c, "{\"jid\":%d,\"pid\":%d,\"status\":%d}\n", c->spawn_jid, c->spawn_pid, c->wait_status);
+    }
+    c->pending = CTL_NONE; 
+    ctl_resume = true; 
 }
 
-void free_job_list(job_list_t *jobs) {
-    job_t *curr = jobs->jobs_list; 
-    while (curr) {
-        job_t *temp = curr; 
-        curr = curr->next; 
-        free(temp->name); 
-        free(temp); 
+// called from handle_exit for a job some client waits on
+void ctl_job_done(job_t *job) {
+    for (size_t s = 0; s < nctl && job->ctl_waits > 0; s++) {
+        ctl_client_t *c = ctl_clients[s];
+        if (!c) {
+            continue; 
+        }
+        for (int i = 0; i < c->nwait; i++) {
+            if (c->wait_jids[i] == job->jid) {
+                c->wait_jids[i] = c->wait_jids[--c->nwait]; 
+                job->ctl_waits--; 
+                if (c->pending != CTL_NUKE) {
+                    c->wait_status = job_exit_code(job);
+                }
+                if (c->nwait == 0) {
+                    ctl_finish(c);
+                }
+                break; 
+            }
+        }
     }
-    free(jobs);
 }
 
-void clean_jobs() {
-    job_t *curr = jobs->jobs_list; 
-    job_t *prev = NULL; 
-    while (curr) {
-        if (kill(curr->pid, 0) == -1) {
-            job_t *temp = curr;
-            if (prev) {
-                prev->next = curr->next; 
-            }
-            prev = curr; 
-            curr = curr->next;
-            if (jobs->jobs_list == prev) {
-                jobs->jobs_list = curr; 
-            }
-            temp->next = NULL; 
-            free(temp);
+// the jobs a wait or nuke request names, by jid with or without %, or every job when none are named;
+// returns how many went into targets, or -1 after replying with an error. A named job that already
+// left the table (serve -f drops them as they end) is looked up in done_ring instead: its exit code
+// goes to *done_status, which stays -1 if there is none
+int ctl_targets(ctl_client_t *c, const char **args, job_t **targets, int *done_status) {
+    int n = 0; 
+    if (args[0] == NULL) {
+        for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+            targets[n++] = curr; 
+        }
+        return n; 
+    }
+    for (int i = 0; args[i]; i++) {
+        const char *str = args[i][0] == '%' ? args[i] + 1 : args[i];
+        char *endptr; 
+        long jid = strtol(str, &endptr, 10);
+        job_t *job = endptr != str && *endptr == '\0' ? get_job_jid(jid) : NULL; 
+        if (job) {
+            targets[n++] = job; 
+        } else if (endptr != str && *endptr == '\0' && jid > 0 && done_ring[jid % DONE_KEEP].jid == jid) {
+            *done_status = status_code(done_ring[jid % DONE_KEEP].status);
         } else {
-            prev = curr; 
-            curr = curr->next; 
+            ctl_error(c, "no job ", str);
+            return -1; 
         }
     }
+    return n; 
 }
 
-int get_jid(pid_t cpid) {
-    if (jobs == NULL || jobs->jobs_list == NULL) {
-        return -1; 
+void ctl_spawn(ctl_client_t *c, const char **toks) {
+    int i = 1; 
+    bool wait = toks[1] && strcmp(toks[1], "-w") == 0; 
+    if (wait) {
+        i++; 
     }
-    job_t *curr = jobs->jobs_list; 
-    while (curr && curr->pid != cpid) {
-        curr = curr->next; 
+    job_opts_t opts = { .timed = false };
+    int k = parse_prefixes(&toks[i], &opts);
+    if (k < 0) {
+        ctl_error(c, "bad options for spawn", NULL);
+        return; 
     }
-    if (!curr) {
-        return -1; 
+    i += k; 
+    if (toks[i] == NULL) {
+        ctl_error(c, "spawn needs a command", NULL);
+        return; 
+    }
+    if (jobs->n_suspended >= 32) {
+        ctl_error(c, "too many jobs", NULL);
+        return; 
+    }
+    job_t *job = start_job(&toks[i], capture_mode, &opts, ctl_act, ctl_act_fg);
+    if (!job) {
+        ctl_error(c, "cannot run ", toks[i]);
+        return; 
+    }
+    apply_opts(job, &opts);
+    job->notified = true; // the client hears how it ended, the terminal doesn't
+    ctl_spawned++; 
+    if (wait) {
+        c->pending = CTL_SPAWN; 
+        c->spawn_jid = job->jid; 
+        c->spawn_pid = job->pid; 
+        ctl_wait_for(c, job);
+    } else {
+        ctl_printf(c, "{\"jid\":%d,\"pid\":%d}\n", job->jid, job->pid);
     }
-    return curr->jid; 
 }
 
-char *get_name(pid_t cpid) {
-    if (jobs == NULL || jobs->jobs_list == NULL)
-        return NULL;
-    job_t *curr = jobs->jobs_list; 
-    while (curr && curr->pid != cpid) {
-        curr = curr->next; 
-    }
-    if (!curr) {
-        return NULL;
+void ctl_jobs(ctl_client_t *c) {
+    struct timespec now; 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ctl_printf(c, "{\"jobs\":[");
+    for (job_t *curr = jobs->jobs_list; curr; curr = curr->next) {
+        ctl_printf(c, "%s{\"jid\":%d,\"pid\":%d,\"state\":\"%s\",\"wall\":%.3f,", curr == jobs->jobs_list ? "" : ",",
+                   curr->jid, curr->pid, curr->exited ? "exited" : curr->node ? "waiting" : curr->suspended ? "suspended" : "running",
+                   elapsed(&curr->start, curr->exited ? &curr->end : &now));
+        if (curr->exited) {
+            ctl_printf(c, "\"status\":%d,", job_exit_code(curr));
+        }
+        ctl_printf(c, "\"name\":");
+        ctl_json_str(c, curr->name);
+        ctl_printf(c, "}");
     }
-    return curr->name; 
+    ctl_printf(c, "]}\n");
 }
 
-job_t *get_job_jid(int jid) {
-    if (jobs == NULL || jobs->jobs_list == NULL) {
-        return NULL; 
+// wait and nuke never block the loop: the reply goes out from ctl_job_done once the last target exits
+void ctl_wait(ctl_client_t *c, const char **toks, bool nuke) {
+    job_t **targets = arena_alloc(&line_arena, (jobs->by_jid.count + 1) * sizeof(job_t *));
+    int done_status = -1; 
+    int n = ctl_targets(c, &toks[1], targets, &done_status);
+    if (n < 0) {
+        return; 
     }
-    job_t *curr = jobs->jobs_list; 
-    while (curr && curr->jid != jid) {
-        curr = curr->next; 
+    c->pending = nuke ? CTL_NUKE : CTL_WAIT; 
+    c->wait_status = done_status >= 0 && !nuke ? done_status : 0; 
+    for (int i = 0; i < n; i++) {
+        if (nuke && !targets[i]->exited) {
+            signal_job(targets[i], SIGKILL);
+            targets[i]->notified = true; 
+        }
+        if (targets[i]->exited) {
+            if (!nuke) {
+                c->wait_status = job_exit_code(targets[i]);
+            }
+        } else {
+            ctl_wait_for(c, targets[i]);
+        }
     }
-    if (!curr) {
-        return NULL; 
+    if (nuke) {
+        c->wait_status = c->nwait; // what the reply counts
+    }
+    if (c->nwait == 0) {
+        ctl_finish(c);
     }
-    return curr; 
 }
 
-job_t *get_job_pid(int pid) {
-    if (jobs == NULL || jobs->jobs_list == NULL) {
-        return NULL; 
+// one request line: spawn [-w] [time|timeout ...|limit ...] cmd, jobs, wait [jid...], nuke [jid...], stats
+void ctl_request(ctl_client_t *c, char *line) {
+    ctl_requests++; 
+    int saved_status = last_status; // a client's request is not the terminal's last command
+    arena_mark_t mark = arena_mark(&line_arena);
+    cmd_t *cmds; 
+    int n = lex(line, &cmds);
+    if (n < 0) {
+        ctl_error(c, "unclosed quote", NULL);
+    } else if (n > 1) {
+        ctl_error(c, "one command per request", NULL);
+    } else if (n == 1) {
+        const char **toks = cmds[0].toks; 
+        if (strcmp(toks[0], "spawn") == 0) {
+            ctl_spawn(c, toks);
+        } else if (strcmp(toks[0], "jobs") == 0) {
+            ctl_jobs(c);
+        } else if (strcmp(toks[0], "wait") == 0 || strcmp(toks[0], "nuke") == 0) {
+            ctl_wait(c, toks, toks[0][0] == 'n');
+        } else if (strcmp(toks[0], "stats") == 0) {
+            ctl_printf(c, "{\"jobs\":%zu,\"suspended\":%d,\"clients\":%zu,\"requests\":%lu,\"spawned\":%lu}\n",
+                       jobs->by_jid.count, jobs->n_suspended, ctl_live, ctl_requests, ctl_spawned);
+        } else {
+            ctl_error(c, "unknown request ", toks[0]);
+        }
     }
-    job_t *curr = jobs->jobs_list; 
-    while (curr && curr->pid != pid) {
-        curr = curr->next; 
+    arena_release(&line_arena, mark);
+    last_status = saved_status; 
+}
+
+// watch for requests unless the client is done sending or not reading its replies, and for room
+// to write when replies are waiting
+void ctl_watch(ctl_client_t *c) {
+    uint32_t events = (!c->eof && c->out_len < CTL_OUT_MAX ? EPOLLIN : 0) | (c->out_len ? EPOLLOUT : 0);
+    if (events != c->events) {
+        struct epoll_event ev = { .events = events, .data.u64 = EV_DATA(EV_CLIENT, c->slot) };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events; 
     }
-    if (!curr) {
-        return NULL; 
+}
+
+// handle what requests we can, write what replies we can; false if the client is gone
+bool ctl_service(ctl_client_t *c) {
+    size_t done = 0; 
+    while (c->pending == CTL_NONE && c->out_len < CTL_OUT_MAX) {
+        char *nl = memchr(c->in + done, '\n', c->in_len - done);
+        if (!nl) {
+            break; 
+        }
+        *nl = '\0'; 
+        ctl_request(c, c->in + done);
+        done = nl - c->in + 1; 
+    }
+    memmove(c->in, c->in + done, c->in_len - done);
+    c->in_len -= done; 
+    while (c->out_len > 0) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n > 0) {
+            memmove(c->out, c->out + n, c->out_len - n);
+            c->out_len -= n; 
+        } else if (n == -1 && errno == EINTR) {
+            continue; 
+        } else if (n == -1 && errno == EAGAIN) {
+            break; 
+        } else {
+            ctl_close(c);
+            return false; 
+        }
+    }
+    if (c->eof && c->pending == CTL_NONE && c->out_len == 0 && !memchr(c->in, '\n', c->in_len)) {
+        ctl_close(c);
+        return false; 
     }
-    return curr; 
+    ctl_watch(c);
+    return true; 
 }
 
-void print_jobs() {
-    job_t *curr = jobs->jobs_list;
-    while (curr) {
-        printf("\tmem addr: %p, jid: %d, pid: %d, name: %s, next: %p, suspended: %d\n", curr, curr->jid, curr->pid, curr->name, curr->next, curr->suspended);
-        curr = curr->next; 
+void ctl_accept() {
+    while (true) {
+        int fd = accept4(ctl_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            break; 
+        }
+        size_t slot = 0; 
+        while (slot < nctl && ctl_clients[slot]) {
+            slot++; 
+        }
+        if (slot == nctl) {
+            ctl_clients = realloc(ctl_clients, ++nctl * sizeof(ctl_client_t *));
+            assert(ctl_clients);
+        }
+        ctl_client_t *c = calloc(1, sizeof(ctl_client_t));
+        assert(c);
+        c->fd = fd; 
+        c->slot = slot; 
+        c->events = EPOLLIN; 
+        ctl_clients[slot] = c; 
+        ctl_live++; 
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_DATA(EV_CLIENT, slot) };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
     }
 }
 
-void kill_all_jobs() {
-    job_t *curr = jobs->jobs_list;
-    char cmd[100];
-    while(curr) {
-        kill(curr->pid, SIGKILL);
-        snprintf(cmd, sizeof(cmd), "[%d] (%d)  killed  %s\n", curr->jid, curr->pid, curr->name);
-        write(STDOUT_FILENO, cmd, strlen(cmd));
-        curr = curr->next;
+void ctl_event(int slot, uint32_t events) {
+    ctl_client_t *c = (size_t)slot < nctl ? ctl_clients[slot] : NULL; 
+    if (!c) {
+        return; 
+    }
+    while ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->eof) {
+        if (c->in_cap - c->in_len < 4096) {
+            if (c->in_cap >= CTL_IN_MAX) {
+                // no newline in all that, not a client of ours
+                ctl_error(c, "request too long", NULL);
+                c->in_len = 0; 
+                c->eof = true; 
+                break; 
+            }
+            c->in_cap = c->in_cap ? c->in_cap * 2 : 8192; 
+            c->in = realloc(c->in, c->in_cap);
+            assert(c->in);
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n > 0) {
+            c->in_len += n; 
+            if (c->in_len > CTL_OUT_MAX || c->out_len >= CTL_OUT_MAX) {
+                break; // let ctl_service catch up first
+            }
+        } else if (n == 0 || errno != EINTR) {
+            c->eof = n == 0 || errno != EAGAIN; 
+            break; 
+        }
+    }
+    if (ctl_service(c) && (events & (EPOLLHUP | EPOLLERR))) {
+        // gone both ways: nobody to answer, and epoll would keep saying so
+        ctl_close(c);
     }
 }
 
-void set_suspended(pid_t pid) {
-    job_t *curr = get_job_pid(pid); 
-    curr->suspended = true; 
+// requests that queued behind a wait, nuke or spawn -w that just finished
+void ctl_resume_all() {
+    ctl_resume = false; 
+    for (size_t s = 0; s < nctl; s++) {
+        if (ctl_clients[s] && ctl_clients[s]->pending == CTL_NONE) {
+            ctl_service(ctl_clients[s]);
+        }
+    }
 }
 
-bool jobs_full() {
-    clean_jobs();
-    int count = 0; 
-    job_t *curr = jobs->jobs_list; 
-    while (curr) {
-        if (curr->suspended) {
-            count++;
+void ctl_stop() {
+    if (ctl_fd == -1) {
+        return; 
+    }
+    for (size_t s = 0; s < nctl; s++) {
+        if (ctl_clients[s]) {
+            ctl_close(ctl_clients[s]);
         }
-        curr = curr->next; 
     }
-    return (count >= 32); 
+    epoll_ctl(epfd, EPOLL_CTL_DEL, ctl_fd, NULL);
+    close(ctl_fd);
+    ctl_fd = -1; 
+    unlink(ctl_path);
 }
 
-void print_status(pid_t p1, const char* name) {
-    char r[100];
-    if (flag_c) {
-        kill(p1, SIGINT); 
-        snprintf(r, sizeof(r), "[%d] (%d)  killed  %s\n", get_curr_jid(jobs), p1, name);
-        write(STDOUT_FILENO, r, strlen(r));
-        flag_c = false; 
-    } else if (flag_q) {
-        kill(p1, SIGQUIT); 
-        snprintf(r, sizeof(r), "[%d] (%d)  killed  %s\n", get_curr_jid(jobs), p1, name);
-        write(STDOUT_FILENO, r, strlen(r));
-        flag_q = false; 
-    } else if(flag_z) {
-        kill(p1, SIGTSTP); 
-        snprintf(r, sizeof(r), "[%d] (%d)  suspended  %s\n", get_curr_jid(jobs), p1, name);
-        write(STDOUT_FILENO, r, strlen(r));
-        flag_z = false;
-        set_suspended(p1);
-    } else {
-        snprintf(r, sizeof(r), "[%d] (%d)  finished  %s\n", get_curr_jid(jobs), p1, name);
-        write(STDOUT_FILENO, r, strlen(r));
+// listen on a Unix socket at path, replacing a stale one; jobs clients spawn get act/act_fg
+bool ctl_listen(const char *path, struct sigaction *act, struct sigaction *act_fg) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        out_printf(STDERR_FILENO, "ERROR: socket path too long: %s\n", path);
+        return false; 
+    }
+    ctl_stop();
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct stat st; 
+    if (fd != -1 && stat(path, &st) == 0 && S_ISSOCK(st.st_mode)
+        && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED) {
+        // left behind by a shell that is gone, nobody answers on it
+        unlink(path);
+    }
+    if (fd != -1) {
+        close(fd);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        out_printf(STDERR_FILENO, "ERROR: cannot listen on %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return false; 
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_DATA(EV_CTL, 0) };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    ctl_fd = fd; 
+    strcpy(ctl_path, path);
+    ctl_act = act; 
+    ctl_act_fg = act_fg; 
+    static bool registered = false; 
+    if (!registered) {
+        atexit(ctl_stop);
+        registered = true; 
     }
+    return true; 
 }
 
-void eval(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) { // bg is true iff command ended with &
-    assert(toks);
-    if (*toks == NULL) return;
-    if (strcmp(toks[0], "quit") == 0) {
-        if (toks[1] != NULL) {
-            const char *msg = "ERROR: quit takes no arguments\n";
-            write(STDERR_FILENO, msg, strlen(msg));
+// serve [-f] PATH: answer requests on a Unix socket from the event loop; -f stays in the loop
+// (for a shell with no terminal) until ^C; serve off stops, a bare serve tells where it listens
+void builtin_serve(const char **toks, bool bg, struct sigaction *act, struct sigaction *act_fg) {
+    bool follow = toks[1] && strcmp(toks[1], "-f") == 0; 
+    const char *path = toks[follow ? 2 : 1];
+    if (path == NULL && !follow) {
+        if (ctl_fd == -1) {
+            out_puts(STDOUT_FILENO, "serve off\n");
         } else {
-            exit(0);
+            out_printf(STDOUT_FILENO, "serve %s  clients %zu  requests %lu\n", ctl_path, ctl_live, ctl_requests);
         }
-    } else if (jobs_full()) {
-        const char *msg = "ERROR: too many jobs\n";
-        write(STDERR_FILENO, msg, strlen(msg));
-    } else if (strcmp(toks[0], "jobs") == 0) {
-        if (toks[1] != NULL) {
-            const char *msg = "ERROR: jobs takes no arguments\n";
-            write(STDERR_FILENO, msg, strlen(msg));
-        } else {
-            // remove dead processes from job list 
-            clean_jobs(); 
-            job_t *curr = jobs->jobs_list; 
-            while (curr != NULL) {
-                char p[100];
-                if (curr->suspended) {
-                    snprintf(p, sizeof(p), "[%d] (%d)  suspended  %s\n", curr->jid, curr->pid, curr->name);
-                    write(STDOUT_FILENO, p, strlen(p));
-                } else {
-                    snprintf(p, sizeof(p), "[%d] (%d)  running  %s\n", curr->jid, curr->pid, curr->name);
-                    write(STDOUT_FILENO, p, strlen(p));
-                }
-                curr = curr->next; 
+        return; 
+    }
+    if (path == NULL || toks[follow ? 3 : 2] != NULL) {
+        out_puts(STDERR_FILENO, "ERROR: usage: serve [-f] PATH | serve off\n");
+        last_status = 2; 
+        return; 
+    }
+    if (strcmp(path, "off") == 0) {
+        ctl_stop();
+        return; 
+    }
+    if (!ctl_listen(path, act, act_fg)) {
+        last_status = 1; 
+        return; 
+    }
+    if (follow) {
+        sigset_t old; 
+        sigprocmask(SIG_BLOCK, &wait_mask, &old);
+        fg = true; 
+        while (!flag_c && !flag_q) {
+            wait_events(-1);
+            flag_z = false; 
+            // nothing else drops the jobs that clients are done with
+            while (jobs->dead) {
+                job_t *job = jobs->dead; 
+                jobs->dead = job->next_dead; 
+                remove_job(jobs, job);
             }
         }
-    } else if (strcmp(toks[0], "nuke") == 0) {
-        if (toks[1] == NULL) {
-            clean_jobs();
-            kill_all_jobs();
-        } 
-
-        int i = 1;
-        while(toks[i]) {
-            job_t *curr; 
-            char cmd2[100];
-            char* endptr; 
-            int saved_errno = errno;
-
-            const char *str = toks[i];
-            if (str[0] == '%') {
-                const char *temp = str; 
-                temp++; 
-                str = temp; 
-            }
+        fg = false; 
+        flag_c = false; 
+        flag_q = false; 
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    }
+}
 
-            long num = strtol(str, &endptr, 10);
-            if (errno == ERANGE || endptr == str || *endptr != '\0') {
-                snprintf(cmd2, sizeof(cmd2), "ERROR: bad argument for nuke: %s\n", toks[i]);
-                write(STDERR_FILENO, cmd2, strlen(cmd2));
-            } else {
-                if (toks[i][0] == '%') {
-                    const char *temp = toks[i];
-                    temp++; 
-                    clean_jobs();
-                    curr = get_job_jid(num);
-                    if (!curr) {
-                        char err[100];
-                        snprintf(err, sizeof(err), "ERROR: no job %s\n", temp);
-                        write(STDERR_FILENO, err, strlen(err));
-                    } else {
-                        char cmd[100];
-                        kill(curr->pid, SIGKILL);
-                        snprintf(cmd, sizeof(cmd), "[%d] (%d)  killed  %s\n", curr->jid, curr->pid, curr->name);
-                        write(STDOUT_FILENO, cmd, strlen(cmd));
-                    }
-                } else {
-                    clean_jobs();
-                    curr = get_job_pid(num); 
-                    if (!curr) {
-                        char err[100];
-                        snprintf(err, sizeof(err), "ERROR: no PID %s\n", toks[i]);
-                        write(STDERR_FILENO, err, strlen(err));
-                    } else {
-                        char cmd[100];
-                        kill(curr->pid, SIGKILL);
-                        snprintf(cmd, sizeof(cmd), "[%d] (%d)  killed  %s\n", curr->jid, curr->pid, curr->name);
-                        write(STDOUT_FILENO, cmd, strlen(cmd));
-                    }
+void parse_and_eval(char *s, struct sigaction* act, struct sigaction *act_fg) {
+    assert(s);
+    cmd_t *cmds; 
+    int ncmds = lex(s, &cmds);
+    if (ncmds < 0) {
+        last_status = 2; 
+        return; 
+    }
+    for (int i = 0; i < ncmds; ) {
+        // an and-or list: commands joined by && and ||, handed to the scheduler as a whole if it ends with &
+        int end = i; 
+        while (cmds[end].op == CMD_AND || cmds[end].op == CMD_OR) {
+            end++; 
+        }
+        if (end > i && cmds[end].op == CMD_BG) {
+            sched_chain(&cmds[i], end - i + 1, act, act_fg);
+        } else {
+            for (int k = i; k <= end; k++) {
+                // left to right like sh: a skipped command leaves last_status for the next operator
+                if (k == i || (cmds[k - 1].op == CMD_AND) == (last_status == 0)) {
+                    eval(cmds[k].toks, cmds[k].op == CMD_BG, act, act_fg);
                 }
             }
-            i++;
-            errno = saved_errno; 
         }
+        i = end + 1; 
+    }
+}
 
-    } else if (strcmp(toks[0], "fg") == 0) {
-        sigprocmask(SIG_BLOCK, &(act->sa_mask), NULL); 
-        if (toks[2] != NULL) {
-            const char *msg = "ERROR: fg needs exactly one argument\n";
-            write(STDERR_FILENO, msg, strlen(msg));
-        } else {
-            job_t *curr; 
-            char cmd2[100];
-            char* endptr; 
-            int saved_errno = errno;
+void input_init(input_t *in, int fd, size_t cap) {
+    in->fd = fd; 
+    in->cap = cap; 
+    in->buf = malloc(in->cap);
+    assert(in->buf);
+    in->start = 0; 
+    in->end = 0; 
+    in->eof = false; 
+    in->error = false; 
+    in->mapped = 0; 
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.u64 = EV_DATA(EV_INPUT, 0) };
+    in->watch = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0; 
+}
 
-            const char *str = toks[1];
-            if (str[0] == '%') {
-                const char *temp = str; 
-                temp++; 
-                str = temp; 
-            }
+// crash -c: the whole input is already in memory
+void input_string(input_t *in, const char *str) {
+    in->fd = -1; 
+    in->end = strlen(str);
+    in->cap = in->end + 1; 
+    in->buf = strdup(str);
+    assert(in->buf);
+    in->start = 0; 
+    in->eof = true; 
+    in->error = false; 
+    in->watch = false; 
+    in->mapped = 0; 
+}
 
-            long num = strtol(str, &endptr, 10);
-            if (errno == ERANGE || endptr == str || *endptr != '\0') {
-                snprintf(cmd2, sizeof(cmd2), "ERROR: bad argument for fg: %s\n", toks[1]);
-                write(STDERR_FILENO, cmd2, strlen(cmd2));
-            } else {
-                // set fg true
-                fg = true; 
-                if (toks[1][0] == '%') {
-                    const char *temp = toks[1];
-                    temp++; 
-                    clean_jobs();
-                    curr = get_job_jid(num);
-                    if (!curr) {
-                        char err[100];
-                        snprintf(err, sizeof(err), "ERROR: no job %s\n", temp);
-                        write(STDERR_FILENO, err, strlen(err));
-                    } else {
-                        if (curr->suspended) {
-                            char cmd[100];
-                            kill(curr->pid, SIGCONT);
-                            snprintf(cmd, sizeof(cmd), "[%d] (%d)  continued  %s\n", curr->jid, curr->pid, curr->name);
-                            write(STDOUT_FILENO, cmd, strlen(cmd));
-                            curr->suspended = false;
-                        }
-                        // waitpid
-                        pid_t p2;
-            
-                        int status;
-                        while((flag_c == false && flag_q == false && flag_z == false)) {
-                            p2 = waitpid(curr->pid, &status, WNOHANG); 
-                            if (p2 > 0) {
-                                break; 
-                            }
-                            sleep(0.001);
-                        }
-                    
-                        print_status(curr->pid, curr->name);
-                        sigprocmask(SIG_UNBLOCK, &(act->sa_mask), NULL);
-                    }
-                } else {
-                    clean_jobs();
-                    curr = get_job_pid(num); 
-                    if (!curr) {
-                        char err[100];
-                        snprintf(err, sizeof(err), "ERROR: no PID %s\n", toks[1]);
-                        write(STDERR_FILENO, err, strlen(err));
-                    } else {
-                        if (curr->suspended) {
-                            char cmd[100];
-                            kill(curr->pid, SIGCONT);
-                            snprintf(cmd, sizeof(cmd), "[%d] (%d)  continued  %s\n", curr->jid, curr->pid, curr->name);
-                            write(STDOUT_FILENO, cmd, strlen(cmd));
-                            curr->suspended = false;
-                        }
-                        // waitpid
-                        pid_t p2;
-
-                        int status;
-                        while((flag_c == false && flag_q == false && flag_z == false)) {
-                            p2 = waitpid(curr->pid, &status, WNOHANG); 
-                            if (p2 > 0) {
-                                break; 
-                            }
-                            sleep(0.001);
-                        }
-
-                        print_status(curr->pid, curr->name);
-                        sigprocmask(SIG_UNBLOCK, &(act->sa_mask), NULL);
-                    }
-                }
-                // set fg false again
-                fg = false; 
-            }
-            errno = saved_errno; 
+// crash script: map regular files whole, read anything else in big chunks
+bool input_script(input_t *in, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st; 
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        return false; 
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        input_init(in, fd, 1 << 16);
+        return true; 
+    }
+    // private pages so read_line can write its terminators, plus one zero byte past the end
+    size_t len = st.st_size + 1; 
+    char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED || mmap(buf, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        if (buf != MAP_FAILED) {
+            munmap(buf, len);
         }
-    } else if (strcmp(toks[0], "bg") == 0) { 
-        if (toks[1] == NULL) {
-            const char *msg = "ERROR: bg needs some arguments\n";
-            write(STDERR_FILENO, msg, strlen(msg));
-        } else {
-            int i = 1;
-            while(toks[i]) {
-                job_t *curr; 
-                char cmd2[100];
-                char* endptr; 
-                int saved_errno = errno;
-
-                const char *str = toks[i];
-                if (str[0] == '%') {
-                    const char *temp = str; 
-                    temp++; 
-                    str = temp; 
-                }
+        input_init(in, fd, 1 << 16);
+        return true; 
+    }
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    close(fd);
+    in->fd = -1; 
+    in->buf = buf; 
+    in->cap = len; 
+    in->start = 0; 
+    in->end = st.st_size; 
+    in->eof = true; 
+    in->error = false; 
+    in->watch = false; 
+    in->mapped = len; 
+    return true; 
+}
 
-                long num = strtol(str, &endptr, 10);
-                if (errno == ERANGE || endptr == str || *endptr != '\0') {
-                    snprintf(cmd2, sizeof(cmd2), "ERROR: bad argument for bg: %s\n", toks[i]);
-                    write(STDERR_FILENO, cmd2, strlen(cmd2));
-                } else {
-                    if (toks[i][0] == '%') {
-                        const char *temp = toks[i];
-                        temp++; 
-                        clean_jobs();
-                        curr = get_job_jid(num);
-                        if (!curr || curr->suspended == false) {
-                            char err[100];
-                            snprintf(err, sizeof(err), "ERROR: no job %s\n", temp);
-                            write(STDERR_FILENO, err, strlen(err));
-                        } else {
-                            char cmd[100];
-                            kill(curr->pid, SIGCONT);
-                            snprintf(cmd, sizeof(cmd), "[%d] (%d)  continued  %s\n", curr->jid, curr->pid, curr->name);
-                            write(STDOUT_FILENO, cmd, strlen(cmd));
-                            curr->suspended = false;
-                        }
-                    } else {
-                        clean_jobs();
-                        curr = get_job_pid(num); 
-                        if (!curr || curr->suspended == false) {
-                            char err[100];
-                            snprintf(err, sizeof(err), "ERROR: no PID %s\n", toks[i]);
-                            write(STDERR_FILENO, err, strlen(err));
-                        } else {
-                            char cmd[100];
-                            kill(curr->pid, SIGCONT);
-                            snprintf(cmd, sizeof(cmd), "[%d] (%d)  continued  %s\n", curr->jid, curr->pid, curr->name);
-                            write(STDOUT_FILENO, cmd, strlen(cmd));
-                            curr->suspended = false;
-                        }
-                    }
-                }
-                i++;
-                errno = saved_errno; 
-            }
-        }
-    } else {
-        sigprocmask(SIG_BLOCK, &(act->sa_mask), NULL);  
-        add_job(jobs, toks[0], getpid());  // add job without pid 
-        if (!bg) {
-            fg = true;
-        }
-        pid_t ppgid = getpgid(getpid());
-        pid_t p1 = fork(); 
-        if (p1 == 0) {
-            sigaction(SIGINT, act_fg, NULL);
-            sigprocmask(SIG_UNBLOCK, &(act->sa_mask), NULL); 
-            // if (bg) {
-            //     sigprocmask(SIG_BLOCK, &(act_fg->sa_mask), NULL);  
-            // }
-            int bandage = errno; 
-            int cpgid = setpgid(getpid(), getpid());
-            errno = bandage; 
-            int error = execvp(toks[0], (char *const *) toks);
-            if (error == -1) {
-                char err[50]; 
-                snprintf(err, sizeof(err), "ERROR: cannot run %s\n", toks[0]);
-                write(STDERR_FILENO, err, strlen(err));
-                exit(1); // will definitely cause problems but works for now
-            }
-        } else {
-            add_pid(jobs, p1);
-            if (bg) {
-                char r[100];
-                snprintf(r, sizeof(r), "[%d] (%d)  running  %s\n", get_curr_jid(jobs), p1, toks[0]);
-                write(STDOUT_FILENO, r, strlen(r));
-            } else {
-                pid_t p2;
-                int status;
-                while((flag_c == false && flag_q == false && flag_z == false)) {
-                    p2 = waitpid(p1, &status, WNOHANG); 
-                    if (p2 > 0) {
-                        break; 
-                    }
-                    sleep(0.001);
-                }
-                print_status(p1, toks[0]);
-                fg = false; 
-            }
-            sigprocmask(SIG_UNBLOCK, &(act->sa_mask), NULL);
-        }
+void input_free(input_t *in) {
+    if (in->mapped) {
+        munmap(in->buf, in->mapped);
+    } else {
+        free(in->buf);
+    }
+    if (in->fd > STDIN_FILENO) {
+        close(in->fd);
     }
 }
 
-void parse_and_eval(char *s, struct sigaction* act, struct sigaction *act_fg) {
-    assert(s);
-    const char *toks[MAXLINE+1];
-    
-    while (*s != '\0') {
-        bool end = false;
-        bool bg = false;
-        int t = 0;
+// keep reaping and reporting jobs until fd has something to read
+void wait_input(input_t *in) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.u64 = EV_DATA(EV_INPUT, 0) };
+    input_ready = false; 
+    epoll_ctl(epfd, EPOLL_CTL_MOD, in->fd, &ev);
+    while (!input_ready) {
+        wait_events(-1);
+    }
+}
 
-        while (*s != '\0' && !end) {
-            while (*s == '\n' || *s == '\t' || *s == ' ') ++s;
-            if (*s != ';' && *s != '&' && *s != '\0') toks[t++] = s;
-            while (strchr("&;\n\t ", *s) == NULL) ++s;
-            switch (*s) {
-            case '&':
-                bg = true;
-                end = true;
-                break;
-            case ';':
-                end = true;
-                break;
+// next line without its newline, NULL at end of input; valid until the next call
+char *read_line(input_t *in) {
+    while (true) {
+        char *nl = memchr(in->buf + in->start, '\n', in->end - in->start);
+        if (nl || (in->eof && in->start < in->end)) {
+            char *line = in->buf + in->start; 
+            if (!nl) {
+                nl = in->buf + in->end; // room is always left for this terminator
+            }
+            *nl = '\0'; 
+            in->start = nl - in->buf + 1; 
+            if (in->start > in->end) {
+                in->start = in->end; 
             }
-            if (*s) *s++ = '\0';
+            return line; 
+        }
+        if (in->eof) {
+            return NULL; 
+        }
+        if (in->start > 0) {
+            memmove(in->buf, in->buf + in->start, in->end - in->start);
+            in->end -= in->start; 
+            in->start = 0; 
+        }
+        if (in->end + 1 >= in->cap) {
+            in->cap *= 2; 
+            in->buf = realloc(in->buf, in->cap);
+            assert(in->buf);
+        }
+        if (in->watch) {
+            wait_input(in);
+        }
+        ssize_t n = read(in->fd, in->buf + in->end, in->cap - in->end - 1);
+        if (n > 0) {
+            in->end += n; 
+        } else if (n == 0) {
+            in->eof = true; 
+        } else if (errno != EINTR && errno != EAGAIN) {
+            in->eof = true; 
+            in->error = true; 
         }
-        toks[t] = NULL;
-        eval(toks, bg, act, act_fg);
     }
 }
 
 void prompt() {
-    const char *prompt = "crash> ";
-    ssize_t nbytes = write(STDOUT_FILENO, prompt, strlen(prompt));
+    if (!interactive) {
+        return; 
+    }
+    out_puts(STDOUT_FILENO, "crash> ");
+    out_flush();
 }
 
 void handle_SIGCHLD(int sig, siginfo_t *info, void *context) {
-    int saved_errno = errno; 
-    int status; 
-    // reap children 
-    while (waitpid(-1, &status, WNOHANG) > 0) {
-        char cmd[100];
-        int jid = get_jid(info->si_pid);
-        if (WIFSIGNALED(status)) {
-            int sig = WTERMSIG(status);
-            if (sig == SIGQUIT || sig == SIGSEGV) {
-                snprintf(cmd, sizeof(cmd), "[%d] (%d)  killed (core dumped)  %s\n", jid,  info->si_pid, get_name(info->si_pid));
-                write(STDOUT_FILENO, cmd, strlen(cmd));
-            } else if (sig == SIGKILL){
-                
-            } else {
-                snprintf(cmd, sizeof(cmd), "[%d] (%d)  killed  %s\n", jid,  info->si_pid, get_name(info->si_pid));
-                write(STDERR_FILENO, cmd, strlen(cmd));
-            }
-        } else {
-            snprintf(cmd, sizeof(cmd), "[%d] (%d)  finished  %s\n", jid,  info->si_pid, get_name(info->si_pid));
-            write(STDOUT_FILENO, cmd, strlen(cmd));
-        }
-    }
-    errno = saved_errno; 
+    // coalesced SIGCHLDs are fine, reap_children() takes every pid wait4 hands back
+    reap_children();
 }
 
 void handle_sigint_sigtstp_sigquit(int sig, siginfo_t *info, void *context) {
@@ -598,12 +5103,18 @@ void handle_sigint_sigtstp_sigquit(int sig, siginfo_t *info, void *context) {
     }
 } 
 
-int repl() {
-    char *buf = NULL;
-    size_t len = 0;
+// cmd is the -c string and script the file to run, both NULL for an interactive session
+int repl(const char *cmd, const char *script) {
+    input_t in; 
     jobs = malloc(sizeof(job_list_t)); 
     jobs->curr_jid = 0;
     jobs->jobs_list = NULL;  
+    jobs->tail = NULL; 
+    jobs->n_suspended = 0; 
+    jobs->dead = NULL; 
+    index_init(&jobs->by_jid);
+    index_init(&jobs->by_pid);
+    init_events();
 
     // signal stuff
     struct sigaction actc;
@@ -624,26 +5135,77 @@ int repl() {
     sigaction(SIGQUIT, &act_fg, NULL);
     sigaction(SIGSTOP, &act_fg, NULL);
 
+    atexit(out_flush);
+    const char *capture_env = getenv("CRASH_CAPTURE");
+    capture_mode = capture_env && strcmp(capture_env, "1") == 0; 
+    const char *cgroup_env = getenv("CRASH_CGROUP");
+    if (cgroup_env && strcmp(cgroup_env, "1") == 0) {
+        cgroup_mode = cgroup_init(); 
+    }
+    const char *stats_env = getenv("CRASH_STATS");
+    stats_on = stats_env && strcmp(stats_env, "1") == 0; 
+    stats_since = now_ns(); 
+    const char *place_env = getenv("CRASH_PLACE");
+    place_mode = place_env && strcmp(place_env, "1") == 0; 
+    const char *subreaper_env = getenv("CRASH_SUBREAPER");
+    if (subreaper_env && strcmp(subreaper_env, "1") == 0) {
+        subreaper_mode = prctl(PR_SET_CHILD_SUBREAPER, 1) == 0; 
+    }
+    const char *state_env = getenv("CRASH_STATE");
+    if (state_env) {
+        state_open(state_env);
+    }
+    const char *socket_env = getenv("CRASH_SOCKET");
+    if (socket_env) {
+        ctl_listen(socket_env, &actc, &act_fg);
+    }
+    const char *log_size_env = getenv("CRASH_LOG_SIZE");
+    if (log_size_env && atol(log_size_env) > 0) {
+        // whole pages, the ring wraps at the end of the mapping
+        long page = sysconf(_SC_PAGESIZE);
+        log_size = (atol(log_size_env) + page - 1) / page * page; 
+    }
+    if (cmd) {
+        interactive = false; 
+        input_string(&in, cmd);
+    } else if (script) {
+        interactive = false; 
+        if (!input_script(&in, script)) {
+            out_printf(STDERR_FILENO, "ERROR: cannot open %s\n", script);
+            return 127; 
+        }
+    } else {
+        input_init(&in, STDIN_FILENO, MAXLINE);
+    }
     while (prompt(), true) {
-        int read_result = getline(&buf, &len, stdin); 
-        if (read_result == -1) {
-            if (!fg) {
-                break; 
-            }
-        } else {
-            parse_and_eval(buf, &actc, &act_fg);
+        char *line = read_line(&in);
+        if (line == NULL) {
+            break; 
         }
+        parse_and_eval(line, &actc, &act_fg);
+        arena_reset(&line_arena);
     }
 
-    if (buf != NULL) free(buf);
-    if (ferror(stdin)) {
-        perror("ERROR");
+    input_free(&in);
+    if (in.error) {
+        out_printf(STDERR_FILENO, "ERROR: %s\n", strerror(errno));
         return 1;
     }
     free_job_list(jobs);
-    return 0;
+    return last_status;
 }
 
 int main(int argc, char **argv) {
-    return repl();
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc != 3) {
+            out_puts(STDERR_FILENO, "usage: crash [-c command | script]\n");
+            return 2; 
+        }
+        return repl(argv[2], NULL);
+    }
+    if (argc > 2) {
+        out_puts(STDERR_FILENO, "usage: crash [-c command | script]\n");
+        return 2; 
+    }
+    return repl(NULL, argc == 2 ? argv[1] : NULL);
 }